@@ -1,5 +1,4 @@
 #include <vector>
-#include <limits>
 #include <iostream>
 #include "tgaimage.h"
 #include "model.h"
@@ -7,65 +6,96 @@
 #include "our_gl.h"
 
 Model *model        = NULL;
-float *shadowbuffer = NULL;
+DepthBuffer *shadowbuffer = NULL;
 
 const int width  = 800;
 const int height = 800;
 
+const bool debug_depth = true; // writes the shadow buffer to depth.tga
+
 Vec3f light_dir(1,1,0);
 Vec3f       eye(1,1,4);
 Vec3f    center(0,0,0);
 Vec3f        up(0,1,0);
 
+// Phong lighting with shadows, shared by the forward shading and the relighting of the G-buffer
+struct Lighting : public ILighting {
+    Vec3f l;                        // light vector
+    mat<4,4,float> uniform_Mshadow; // transform framebuffer screen coordinates to shadowbuffer screen coordinates
+
+    Lighting() : l(), uniform_Mshadow() {}
+    Lighting(Vec3f L, Matrix MS) : l(L), uniform_Mshadow(MS) {}
+
+    virtual TGAColor light(const Surface &s) {
+        Vec4f sb_p = uniform_Mshadow*embed<4>(s.position); // corresponding point in the shadow buffer
+        sb_p = sb_p/sb_p[3];
+        float shadow = .3+.7*(shadowbuffer->get(int(sb_p[0]), int(sb_p[1]))<sb_p[2]+1.f); // magic coeff, +1 to avoid z-fighting
+        Vec3f n = s.normal;
+        Vec3f r = (n*(n*l*2.f) - l).normalize();   // reflected light
+        float spec = pow(std::max(r.z, 0.0f), s.specular);
+        float diff = std::max(0.f, n*l);
+        TGAColor c = s.albedo, color;
+        for (int i=0; i<3; i++) color[i] = std::min<float>(20 + c[i]*shadow*(1.2*diff + .6*spec), 255);
+        return color;
+    }
+};
+
 struct Shader : public IShader {
-    mat<4,4,float> uniform_M;   //  Projection*ModelView
     mat<4,4,float> uniform_MIT; // (Projection*ModelView).invert_transpose()
-    mat<4,4,float> uniform_Mshadow; // transform framebuffer screen coordinates to shadowbuffer screen coordinates
+    Lighting lighting;          // used by the forward shading only, the G-buffer is lit afterwards
     mat<2,3,float> varying_uv;  // triangle uv coordinates, written by the vertex shader, read by the fragment shader
-    mat<3,3,float> varying_tri; // triangle coordinates before Viewport transform, written by VS, read by FS
+    mat<4,3,float> varying_tri; // homogeneous screen coordinates of the triangle, they are interpolated before the division by w
+
+    Shader(Matrix MIT, Lighting L) : uniform_MIT(MIT), lighting(L), varying_uv(), varying_tri() {}
 
-    Shader(Matrix M, Matrix MIT, Matrix MS) : uniform_M(M), uniform_MIT(MIT), uniform_Mshadow(MS), varying_uv(), varying_tri() {}
+    virtual IShader *clone() const {
+        return new Shader(*this);
+    }
 
     virtual Vec4f vertex(int iface, int nthvert) {
         varying_uv.set_col(nthvert, model->uv(iface, nthvert));
         Vec4f gl_Vertex = Viewport*Projection*ModelView*embed<4>(model->vert(iface, nthvert));
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex/gl_Vertex[3]));
+        varying_tri.set_col(nthvert, gl_Vertex);
         return gl_Vertex;
     }
 
     virtual bool fragment(Vec3f bar, TGAColor &color) {
-        Vec4f sb_p = uniform_Mshadow*embed<4>(varying_tri*bar); // corresponding point in the shadow buffer
-        sb_p = sb_p/sb_p[3];
-        int idx = int(sb_p[0]) + int(sb_p[1])*width; // index in the shadowbuffer array
-        float shadow = .3+.7*(shadowbuffer[idx]<sb_p[2]); // magic coeff to avoid z-fighting
+        Surface s;
+        Shader::surface(bar, s);
+        color = lighting.Lighting::light(s);
+        return false;
+    }
+
+    virtual int fragments(const Vec3f *bar, int mask, TGAColor *colors) {
+        for (int i=0; i<batchsize; i++)
+            if (mask>>i & 1) Shader::fragment(bar[i], colors[i]);
+        return mask;
+    }
+
+    virtual bool surface(Vec3f bar, Surface &s) {
         Vec2f uv = varying_uv*bar;                 // interpolate uv for the current pixel
-        Vec3f n = proj<3>(uniform_MIT*embed<4>(model->normal(uv))).normalize(); // normal
-        Vec3f l = proj<3>(uniform_M  *embed<4>(light_dir        )).normalize(); // light vector
-        Vec3f r = (n*(n*l*2.f) - l).normalize();   // reflected light
-        float spec = pow(std::max(r.z, 0.0f), model->specular(uv));
-        float diff = std::max(0.f, n*l);
-        TGAColor c = model->diffuse(uv);
-        for (int i=0; i<3; i++) color[i] = std::min<float>(20 + c[i]*shadow*(1.2*diff + .6*spec), 255);
+        Vec4f p = varying_tri*bar;
+        s.position = proj<3>(p/p[3]);
+        s.normal   = proj<3>(uniform_MIT*embed<4>(model->normal(uv))).normalize();
+        s.albedo   = model->diffuse(uv);
+        s.specular = model->specular(uv);
         return false;
     }
 };
 
+// the shadow buffer is rendered depth only, the vertex shader is all it needs
 struct DepthShader : public IShader {
-    mat<3,3,float> varying_tri;
-
-    DepthShader() : varying_tri() {}
+    virtual IShader *clone() const {
+        return new DepthShader(*this);
+    }
 
     virtual Vec4f vertex(int iface, int nthvert) {
         Vec4f gl_Vertex = embed<4>(model->vert(iface, nthvert)); // read the vertex from .obj file
-        gl_Vertex = Viewport*Projection*ModelView*gl_Vertex;          // transform it to screen coordinates
-        varying_tri.set_col(nthvert, proj<3>(gl_Vertex/gl_Vertex[3]));
-        return gl_Vertex;
+        return Viewport*Projection*ModelView*gl_Vertex;           // transform it to screen coordinates
     }
 
-    virtual bool fragment(Vec3f bar, TGAColor &color) {
-        Vec3f p = varying_tri*bar;
-        color = TGAColor(255, 255, 255)*(p.z/depth);
-        return false;
+    virtual bool fragment(Vec3f, TGAColor &) {
+        return true; // never called by the depth only draw()
     }
 };
 
@@ -75,56 +105,58 @@ int main(int argc, char** argv) {
         return 1;
     }
 
-    float *zbuffer = new float[width*height];
-    shadowbuffer   = new float[width*height];
-    for (int i=width*height; --i; ) {
-        zbuffer[i] = shadowbuffer[i] = -std::numeric_limits<float>::max();
-    }
+    shadowbuffer = new DepthBuffer(width, height, 1, DEPTH_UNORM16); // the shadow test needs no more than 16 bits
 
     model = new Model(argv[1]);
     light_dir.normalize();
+    cull(CULL_BACK); // the back faces of the models are hidden behind the front ones anyway
+
+    // the geometry pass is done once per camera: the surface attributes of the visible pixels are kept in the G-buffer
+    GBuffer gbuffer(width, height);
+    lookat(eye, center, up);
+    viewport(width/8, height/8, width*3/4, height*3/4);
+    projection(-1.f/(eye-center).norm());
+    Matrix MV = ModelView;
+    Matrix M  = Viewport*Projection*ModelView;
+
+    { // rendering the G-buffer
+        DepthBuffer zbuffer(width, height);
+        VisibilityBuffer vbuffer(width, height); // the surface attributes are fetched once per pixel, whatever the overdraw
+        Shader shader((Projection*ModelView).invert_transpose(), Lighting());
+        draw(0, shader, model->nfaces(), vbuffer, zbuffer);
+        resolve(shader, 0, vbuffer, gbuffer);
+    }
 
+    // a new light costs the shadow buffer and the relighting only, the scene is not rasterized again from the camera
     { // rendering the shadow buffer
-        TGAImage depth(width, height, TGAImage::RGB);
         lookat(light_dir, center, up);
         viewport(width/8, height/8, width*3/4, height*3/4);
         projection(0);
 
         DepthShader depthshader;
-        Vec4f screen_coords[3];
-        for (int i=0; i<model->nfaces(); i++) {
-            for (int j=0; j<3; j++) {
-                screen_coords[j] = depthshader.vertex(i, j);
-            }
-            triangle(screen_coords, depthshader, depth, shadowbuffer);
-        }
-        depth.flip_vertically(); // to place the origin in the bottom left corner of the image
-        depth.write_tga_file("depth.tga");
+        draw(depthshader, model->nfaces(), *shadowbuffer);
     }
 
-    Matrix M = Viewport*Projection*ModelView;
+    if (debug_depth) { // the gray levels of the shadow buffer
+        ColorBuffer depth(width, height);
+        visualize(*shadowbuffer, depth);
+        TGAImage image(width, height, TGAImage::RGB);
+        untile(depth, image);
+        image.flip_vertically(); // to place the origin in the bottom left corner of the image
+        image.write_tga_file("depth.tga");
+    }
 
     { // rendering the frame buffer
-        TGAImage frame(width, height, TGAImage::RGB);
-        lookat(eye, center, up);
-        viewport(width/8, height/8, width*3/4, height*3/4);
-        projection(-1.f/(eye-center).norm());
-
-        Shader shader(ModelView, (Projection*ModelView).invert_transpose(), M*(Viewport*Projection*ModelView).invert());
-        Vec4f screen_coords[3];
-        for (int i=0; i<model->nfaces(); i++) {
-            for (int j=0; j<3; j++) {
-                screen_coords[j] = shader.vertex(i, j);
-            }
-            triangle(screen_coords, shader, frame, zbuffer);
-        }
-        frame.flip_vertically(); // to place the origin in the bottom left corner of the image
-        frame.write_tga_file("framebuffer.tga");
+        ColorBuffer frame(width, height);
+        Lighting lighting(proj<3>(MV*embed<4>(light_dir)).normalize(), Viewport*Projection*ModelView*M.invert());
+        relight(lighting, gbuffer, frame);
+        TGAImage image(width, height, TGAImage::RGB);
+        untile(frame, image);
+        image.flip_vertically(); // to place the origin in the bottom left corner of the image
+        image.write_tga_file("framebuffer.tga");
     }
 
     delete model;
-    delete [] zbuffer;
-    delete [] shadowbuffer;
+    delete shadowbuffer;
     return 0;
 }
-
@@ -1,14 +1,238 @@
 #include <cmath>
 #include <limits>
 #include <cstdlib>
+#include <cassert>
 #include "our_gl.h"
 
 Matrix ModelView;
 Matrix Viewport;
 Matrix Projection;
+CullMode Culling = CULL_NONE;
+BlendMode Blending = BLEND_NONE;
 
 IShader::~IShader() {}
 
+int IShader::fragments(const Vec3f *bar, int mask, TGAColor *colors) {
+    for (int i=0; i<batchsize; i++)
+        if (mask>>i & 1 && fragment(bar[i], colors[i])) mask &= ~(1<<i);
+    return mask;
+}
+
+bool IShader::surface(Vec3f, Surface &) {
+    return true;
+}
+
+ILighting::~ILighting() {}
+
+IRowOutput::~IRowOutput() {}
+
+DepthBuffer::DepthBuffer(int w, int h, int samples, DepthFormat format) : width(w), height(h), samples(samples), format(format),
+    scale(format==DEPTH_FLOAT32 ? 1.f : (format==DEPTH_UNORM24 ? 16777215.f : 65535.f)/depth), maxvalue(depth*scale),
+    coarse_width((w+hizsize-1)/hizsize), coarse_height((h+hizsize-1)/hizsize),
+    data(format==DEPTH_FLOAT32 ? padded(w, h)*samples : 0), data24(format==DEPTH_UNORM24 ? padded(w, h)*samples : 0),
+    data16(format==DEPTH_UNORM16 ? padded(w, h)*samples : 0), coarse(coarse_width*coarse_height), cleared(ntiles(w, h), 1),
+    clearvalue(format==DEPTH_FLOAT32 ? -std::numeric_limits<float>::max() : 0.f) {}
+
+float DepthBuffer::get(int x, int y) const {
+    if (x<0 || y<0 || x>=width || y>=height) return -std::numeric_limits<float>::max();
+    int i = index(x, y);
+    return (cleared[i/(tilesize*tilesize*samples)] ? clearvalue : load(i))/scale;
+}
+
+void DepthBuffer::clear() {
+    std::fill(cleared.begin(), cleared.end(), 1);
+}
+
+void DepthBuffer::touch(int tile) {
+    if (!cleared[tile]) return;
+    cleared[tile] = 0;
+    int n = tilesize*tilesize*samples;
+    if (format==DEPTH_FLOAT32) std::fill(data.begin()+tile*n, data.begin()+(tile+1)*n, clearvalue);
+    else if (format==DEPTH_UNORM24) std::fill(data24.begin()+tile*n, data24.begin()+(tile+1)*n, (unsigned int)clearvalue);
+    else std::fill(data16.begin()+tile*n, data16.begin()+(tile+1)*n, (unsigned short)clearvalue);
+    int ntilesx = (width+tilesize-1)/tilesize, nblocks = tilesize/hizsize;
+    int bx0 = tile%ntilesx*nblocks, by0 = tile/ntilesx*nblocks;
+    for (int by=by0; by<std::min(by0+nblocks, coarse_height); by++)
+        for (int bx=bx0; bx<std::min(bx0+nblocks, coarse_width); bx++)
+            coarse[bx+by*coarse_width] = clearvalue;
+}
+
+void DepthBuffer::update_coarse(int bx, int by) {
+    float zmin = std::numeric_limits<float>::max();
+    int n = (std::min(bx*hizsize+hizsize, width)-bx*hizsize)*samples; // a block never crosses a tile, its rows are contiguous
+    for (int y=by*hizsize; y<std::min(by*hizsize+hizsize, height); y++) {
+        int row = index(bx*hizsize, y);
+        for (int i=0; i<n; i++)
+            zmin = std::min(zmin, load(row+i));
+    }
+    coarse[bx+by*coarse_width] = zmin;
+}
+
+ColorBuffer::ColorBuffer(int w, int h) : width(w), height(h), data(padded(w, h)), cleared(ntiles(w, h), 1), clearvalue(0) {}
+
+TGAColor ColorBuffer::get(int x, int y) const {
+    TGAColor ret;
+    if (x<0 || y<0 || x>=width || y>=height) return ret;
+    int i = index(x, y);
+    memcpy(ret.bgra, cleared[i/(tilesize*tilesize)] ? &clearvalue : &data[i], 4);
+    ret.bytespp = 4;
+    return ret;
+}
+
+void ColorBuffer::set(int x, int y, const TGAColor &color) {
+    if (x<0 || y<0 || x>=width || y>=height) return;
+    int i = index(x, y);
+    touch(i/(tilesize*tilesize));
+    data[i] = pack(color);
+}
+
+void ColorBuffer::clear(const TGAColor &color) {
+    clearvalue = pack(color);
+    std::fill(cleared.begin(), cleared.end(), 1);
+}
+
+void ColorBuffer::touch(int tile) {
+    if (!cleared[tile]) return;
+    cleared[tile] = 0;
+    std::fill(data.begin()+tile*tilesize*tilesize, data.begin()+(tile+1)*tilesize*tilesize, clearvalue);
+}
+
+// the rows of a tile are contiguous, they are copied to the image one tile row at a time; the cleared tiles are written
+// from the clear value, their memory is not read
+void untile(const ColorBuffer &buffer, TGAImage &image) {
+    assert(image.get_width()==buffer.width && image.get_height()==buffer.height);
+    int bpp = image.get_bytespp();
+    unsigned char *out = image.buffer();
+    std::vector<unsigned int> clearrow(tilesize, buffer.clearvalue);
+#pragma omp parallel for
+    for (int y=0; y<buffer.height; y++) {
+        for (int x0=0; x0<buffer.width; x0+=tilesize) {
+            int i = buffer.index(x0, y);
+            const unsigned char *in = reinterpret_cast<const unsigned char *>(buffer.cleared[i/(tilesize*tilesize)] ? &clearrow[0] : &buffer.data[i]);
+            unsigned char *dst = out + (x0+y*buffer.width)*bpp;
+            int n = std::min(tilesize, buffer.width-x0);
+            if (bpp==4) {
+                memcpy(dst, in, n*4);
+                continue;
+            }
+            for (int i=0; i<n; i++)
+                for (int b=0; b<bpp; b++) dst[i*bpp+b] = in[i*4+b];
+        }
+    }
+}
+
+MultisampleImage::MultisampleImage(int w, int h, int samples) : width(w), height(h), samples(samples), data(padded(w, h)*samples),
+    cleared(ntiles(w, h), 1), clearvalue(0) {
+    assert(samples==4 || samples==8);
+}
+
+void MultisampleImage::clear(const TGAColor &color) {
+    clearvalue = pack(color);
+    std::fill(cleared.begin(), cleared.end(), 1);
+}
+
+void MultisampleImage::touch(int tile) {
+    if (!cleared[tile]) return;
+    cleared[tile] = 0;
+    int n = tilesize*tilesize*samples;
+    std::fill(data.begin()+tile*n, data.begin()+(tile+1)*n, clearvalue);
+}
+
+VisibilityBuffer::VisibilityBuffer(int w, int h) : width(w), height(h), ids(padded(w, h)), cleared(ntiles(w, h), 1) {}
+
+void VisibilityBuffer::clear() {
+    std::fill(cleared.begin(), cleared.end(), 1);
+}
+
+void VisibilityBuffer::touch(int tile) {
+    if (!cleared[tile]) return;
+    cleared[tile] = 0;
+    std::fill(ids.begin()+tile*tilesize*tilesize, ids.begin()+(tile+1)*tilesize*tilesize, novisible);
+}
+
+OITBuffer::OITBuffer(int w, int h, int layers) : width(w), height(h), layers(layers), colors(padded(w, h)*layers),
+    depths(padded(w, h)*layers), counts(padded(w, h)), cleared(ntiles(w, h), 1) {
+    assert(layers>=1 && layers<=maxlayers);
+}
+
+// the color of the fragment a seen over the fragment b, premultiplied like in the blend stage (see BLEND_OVER)
+static TGAColor over(const TGAColor &a, const TGAColor &b) {
+    TGAColor ret(0, 0, 0, 0);
+    for (int i=0; i<4; i++) ret.bgra[i] = std::min(a.bgra[i]+mul255(b.bgra[i], 255-a.bgra[3]), 255);
+    return ret;
+}
+
+static TGAColor unpack(unsigned int v) {
+    TGAColor ret(0, 0, 0, 0);
+    memcpy(ret.bgra, &v, 4);
+    return ret;
+}
+
+// with all the layers taken, the new fragment takes its place in the sorted list and the two farthest entries are merged
+void OITBuffer::insert(int i, float d, const TGAColor &color) {
+    unsigned int *c = &colors[i*layers];
+    float *z = &depths[i*layers];
+    int n = counts[i];
+    int k = 0; // the fragments are sorted by decreasing depth, the greater the closer
+    while (k<n && z[k]>=d) k++;
+    int last = n; // the entries [k, last) move one layer farther
+    if (n==layers) {
+        if (k==n) { // the new fragment is the farthest one
+            c[n-1] = pack(over(unpack(c[n-1]), color));
+            return;
+        }
+        if (k==n-1) {
+            c[n-1] = pack(over(color, unpack(c[n-1])));
+            z[n-1] = d;
+            return;
+        }
+        c[n-1] = pack(over(unpack(c[n-2]), unpack(c[n-1])));
+        z[n-1] = z[n-2];
+        last = n-2; // the last but one layer is free
+    } else counts[i]++;
+    for (int j=last; j>k; j--) {
+        c[j] = c[j-1];
+        z[j] = z[j-1];
+    }
+    c[k] = pack(color);
+    z[k] = d;
+}
+
+void OITBuffer::clear() {
+    std::fill(cleared.begin(), cleared.end(), 1);
+}
+
+void OITBuffer::touch(int tile) {
+    if (!cleared[tile]) return;
+    cleared[tile] = 0;
+    std::fill(counts.begin()+tile*tilesize*tilesize, counts.begin()+(tile+1)*tilesize*tilesize, 0);
+}
+
+GBuffer::GBuffer(int w, int h) : width(w), height(h), data(w*h), covered(w*h, 0), cleared(ntiles(w, h), 1) {}
+
+void GBuffer::clear() {
+    std::fill(cleared.begin(), cleared.end(), 1);
+}
+
+// the G-buffer is not tiled, the tile is reset row by row
+void GBuffer::touch(int tile) {
+    if (!cleared[tile]) return;
+    cleared[tile] = 0;
+    int ntilesx = (width+tilesize-1)/tilesize;
+    int x0 = tile%ntilesx*tilesize, y0 = tile/ntilesx*tilesize, n = std::min(tilesize, width-x0);
+    for (int y=y0; y<std::min(y0+tilesize, height); y++)
+        std::fill(covered.begin()+x0+y*width, covered.begin()+x0+y*width+n, 0);
+}
+
+ShadingRates::ShadingRates(int w, int h, ShadingRate rate, float threshold) : ntilesx((w+tilesize-1)/tilesize), ntilesy((h+tilesize-1)/tilesize),
+    threshold(threshold), rates(ntilesx*ntilesy, rate) {}
+
+void ShadingRates::set(int x0, int y0, int x1, int y1, ShadingRate rate) {
+    for (int ty=std::max(y0, 0)/tilesize; ty<=std::min(y1/tilesize, ntilesy-1); ty++)
+        for (int tx=std::max(x0, 0)/tilesize; tx<=std::min(x1/tilesize, ntilesx-1); tx++)
+            rates[tx+ty*ntilesx] = rate;
+}
+
 void viewport(int x, int y, int w, int h) {
     Viewport = Matrix::identity();
     Viewport[0][3] = x+w/2.f;
@@ -24,6 +248,14 @@ void projection(float coeff) {
     Projection[3][2] = coeff;
 }
 
+void cull(CullMode mode) {
+    Culling = mode;
+}
+
+void blend(BlendMode mode) {
+    Blending = mode;
+}
+
 void lookat(Vec3f eye, Vec3f center, Vec3f up) {
     Vec3f z = (eye-center).normalize();
     Vec3f x = cross(up,z).normalize();
@@ -37,43 +269,355 @@ void lookat(Vec3f eye, Vec3f center, Vec3f up) {
     }
 }
 
-Vec3f barycentric(Vec2f A, Vec2f B, Vec2f C, Vec2f P) {
-    Vec3f s[2];
-    for (int i=2; i--; ) {
-        s[i][0] = C[i]-A[i];
-        s[i][1] = B[i]-A[i];
-        s[i][2] = A[i]-P[i];
+static const float wnear     = 1e-2f;   // near clipping plane w=wnear, the camera itself lies in the w=0 plane
+static const float guardband = 16384.f; // screen coordinates beyond [-guardband, guardband] are clipped, the rest is scissored
+
+// the cull stage, it runs right after the vertex shader: det(x y w) has the sign of the screen area of the triangle
+// (counterclockwise is front facing), it stays valid for the triangles crossing the w=0 plane, so no clipping is needed first
+bool culled(Vec4f *pts) {
+    float det = pts[0][0]*(pts[1][1]*pts[2][3]-pts[1][3]*pts[2][1])
+              - pts[0][1]*(pts[1][0]*pts[2][3]-pts[1][3]*pts[2][0])
+              + pts[0][3]*(pts[1][0]*pts[2][1]-pts[1][1]*pts[2][0]);
+    if (det==0) return true; // zero area
+    return (Culling==CULL_BACK && det<0) || (Culling==CULL_FRONT && det>0);
+}
+
+// the value is non negative iff p lies inside the k-th clipping plane
+static float plane(int k, const Vec4f &p) {
+    switch (k) {
+        case 0:  return p[3]-wnear;
+        case 1:  return p[0]+guardband*p[3];
+        case 2:  return guardband*p[3]-p[0];
+        case 3:  return p[1]+guardband*p[3];
+        case 4:  return guardband*p[3]-p[1];
+        case 5:  return p[2];               // the depth range [0, depth] of the unorm formats
+        default: return depth*p[3]-p[2];
+    }
+}
+
+// Sutherland-Hodgman clipping of the triangle against the near plane and the guard band in the homogeneous space,
+// and against the depth range if asked; returns the number of vertices of the resulting convex polygon (0 if nothing is
+// left); bars receives the barycentric coordinates of the polygon vertices with respect to the input triangle
+int clip(Vec4f *pts, Vec4f *poly, Vec3f *bars, bool &clipped, bool depthrange) {
+    int n = 3;
+    for (int i=0; i<3; i++) {
+        poly[i] = pts[i];
+        bars[i] = Vec3f(i==0, i==1, i==2);
+    }
+    clipped = false;
+    for (int k=0; k<(depthrange ? 7 : 5) && n>=3; k++) {
+        bool out = false;
+        for (int i=0; i<n; i++) out |= plane(k, poly[i])<0;
+        if (!out) continue;
+        clipped = true;
+        Vec4f p[maxclip];
+        Vec3f b[maxclip];
+        int m = 0;
+        for (int i=0; i<n; i++) {
+            int j = (i+1)%n;
+            float di = plane(k, poly[i]), dj = plane(k, poly[j]);
+            if (di>=0) {
+                p[m] = poly[i];
+                b[m++] = bars[i];
+            }
+            if ((di>=0)!=(dj>=0)) {
+                float t = di/(di-dj);
+                p[m] = poly[i] + (poly[j]-poly[i])*t;
+                b[m++] = bars[i] + (bars[j]-bars[i])*t;
+            }
+        }
+        for (n=0; n<m; n++) {
+            poly[n] = p[n];
+            bars[n] = b[n];
+        }
+    }
+    return n<3 ? 0 : n;
+}
+
+// pixel bounding box of the n screen points intersected with the [rmin, rmax] rectangle, false if the intersection is empty;
+// the box is grown by the margin, the samples of a multisampled pixel lie up to half a pixel away from its center
+bool bbox(Vec2f *s, int n, Vec2i rmin, Vec2i rmax, Vec2i &bboxmin, Vec2i &bboxmax, int margin) {
+    for (int j=0; j<2; j++) {
+        float lo = s[0][j], hi = s[0][j];
+        for (int i=1; i<n; i++) {
+            lo = std::min(lo, s[i][j]);
+            hi = std::max(hi, s[i][j]);
+        }
+        bboxmin[j] = std::max<float>(rmin[j], std::floor(lo)-margin);
+        bboxmax[j] = std::min<float>(rmax[j], std::floor(hi)+margin);
+    }
+    return bboxmin.x<=bboxmax.x && bboxmin.y<=bboxmax.y;
+}
+
+bool face_bbox(Vec4f *pts, Vec2i rmin, Vec2i rmax, Vec2i &bboxmin, Vec2i &bboxmax, int margin, bool depthrange) {
+    Vec4f poly[maxclip];
+    Vec3f bars[maxclip];
+    Vec2f s[maxclip];
+    bool clipped;
+    int n = clip(pts, poly, bars, clipped, depthrange);
+    for (int j=0; j<n; j++) { // snapped like in setup(), the bbox must hold the pixels the triangles are rasterized to
+        Vec2f v = proj<2>(poly[j]/poly[j][3]);
+        s[j] = Vec2f(std::floor(v.x*subpixel+.5f)/subpixel, std::floor(v.y*subpixel+.5f)/subpixel);
+    }
+    return n && bbox(s, n, rmin, rmax, bboxmin, bboxmax, margin);
+}
+
+// s holds the screen coordinates of the vertices, they are snapped to the fixed point grid here. The conservative edge
+// functions are pushed outwards by the half extent of a pixel, the pixel is covered iff its square touches the triangle
+// (overestimated at the sharp corners, the bbox limits it); the depth at its center is clamped to the triangle depth
+bool setup(Vec4f *pts, Vec2f *s, Vec3f *bars, Setup &t, bool conservative) {
+    int64_t X[3], Y[3];
+    for (int i=0; i<3; i++) {
+        X[i] = (int64_t)std::floor(s[i].x*subpixel+.5f);
+        Y[i] = (int64_t)std::floor(s[i].y*subpixel+.5f);
+        s[i] = Vec2f(X[i]/(float)subpixel, Y[i]/(float)subpixel);
+    }
+    int64_t iarea = (X[1]-X[0])*(Y[2]-Y[0]) - (Y[1]-Y[0])*(X[2]-X[0]); // doubled signed area, 24.8
+    if (!iarea) return false; // degenerate triangle, nothing to draw
+    int sign = iarea>0 ? 1 : -1;
+    for (int i=0; i<3; i++) {
+        int j = (i+1)%3, k = (i+2)%3;
+        int64_t a = (Y[j]-Y[k])*sign, b = (X[k]-X[j])*sign;
+        t.ia[i] = (int)a*subpixel;
+        t.ib[i] = (int)b*subpixel;
+        t.ox[i] = X[j];
+        t.oy[i] = Y[j];
+        t.bias[i] = (a>0 || (a==0 && b<0)) ? 0 : -1; // fill rule: the pixels lying exactly on an edge belong to the triangle iff
+                                                    // it is a left edge (or a horizontal one with the triangle below)
+        if (conservative) t.bias[i] += (subpixel/2)*(std::abs(a)+std::abs(b));
+    }
+
+    float area = iarea/float(subpixel*subpixel);
+    for (int i=0; i<3; i++) {
+        Vec2f &u = s[(i+1)%3], &v = s[(i+2)%3];
+        t.ex[i] = (u.y-v.y)/area;
+        t.ey[i] = (v.x-u.x)/area;
+        t.o[i]  = u;
+    }
+    t.zs = Vec3f(pts[0][2], pts[1][2], pts[2][2]);
+    t.ws = Vec3f(pts[0][3], pts[1][3], pts[2][3]);
+    for (int j=0; j<3; j++) t.Q.set_col(j, (bars ? bars[j] : Vec3f(j==0, j==1, j==2))/pts[j][3]);
+    t.qx = t.Q*t.ex;
+    t.zx = t.zs*t.ex;
+    t.wx = t.ws*t.ex;
+    t.depthmax = std::max(pts[0][2]/pts[0][3], std::max(pts[1][2]/pts[1][3], pts[2][2]/pts[2][3]));
+    t.zmax = conservative ? t.depthmax : std::numeric_limits<float>::max();
+#ifdef __SSE2__
+    const __m128 lane = _mm_set_ps(3.f, 2.f, 1.f, 0.f);
+    for (int i=0; i<3; i++) {
+        t.ia4[i]    = _mm_set_epi32(3*t.ia[i], 2*t.ia[i], t.ia[i], 0);
+        t.istep4[i] = _mm_set1_epi32(4*t.ia[i]);
+        t.qx4[i]    = _mm_mul_ps(_mm_set1_ps(t.qx[i]), lane);
+        t.qstep4[i] = _mm_set1_ps(t.qx[i]*4.f);
+    }
+    t.zx4 = _mm_mul_ps(_mm_set1_ps(t.zx), lane);
+    t.wx4 = _mm_mul_ps(_mm_set1_ps(t.wx), lane);
+    t.zstep4 = _mm_set1_ps(t.zx*4.f);
+    t.wstep4 = _mm_set1_ps(t.wx*4.f);
+    t.zmax4  = _mm_set1_ps(t.zmax);
+#endif
+    return true;
+}
+
+// the standard sample patterns, in 1/subpixel units relative to the pixel center
+static const int pattern4[4][2] = { {-2,-6}, {6,-2}, {-6,2}, {2,6} };
+static const int pattern8[8][2] = { {1,-3}, {-1,3}, {5,1}, {-3,-5}, {-5,5}, {-7,-1}, {3,7}, {7,-7} };
+
+void setup_samples(const Setup &t, int samples, SampleSetup &ss) {
+    const int (*pattern)[2] = samples==8 ? pattern8 : pattern4;
+    for (int k=0; k<samples; k++) {
+        int dx = pattern[k][0], dy = pattern[k][1];
+        for (int i=0; i<3; i++) ss.e[k][i] = (t.ia[i]/subpixel)*dx + (t.ib[i]/subpixel)*dy;
+        Vec3f c = t.ex*(dx/float(subpixel)) + t.ey*(dy/float(subpixel));
+        ss.q[k] = t.Q*c;
+        ss.z[k] = t.zs*c;
+        ss.w[k] = t.ws*c;
     }
-    Vec3f u = cross(s[0], s[1]);
-    if (std::abs(u[2])>1e-2) // dont forget that u[2] is integer. If it is zero then triangle ABC is degenerate
-        return Vec3f(1.f-(u.x+u.y)/u.z, u.y/u.z, u.x/u.z);
-    return Vec3f(-1,1,1); // in this case generate negative coordinates, it will be thrown away by the rasterizator
 }
 
-void triangle(Vec4f *pts, IShader &shader, TGAImage &image, float *zbuffer) {
-    Vec2f bboxmin( std::numeric_limits<float>::max(),  std::numeric_limits<float>::max());
-    Vec2f bboxmax(-std::numeric_limits<float>::max(), -std::numeric_limits<float>::max());
+// fixed point edge functions at the pixel (x,y); the values are clamped to +-2^30: the vertices lie inside the guard band,
+// thus walking a hizsize x hizsize block changes them by less than 2^27, and such a step can neither overflow nor change the sign
+void edges(const Setup &t, int x, int y, int *e) {
+    const int64_t emax = 1<<30;
     for (int i=0; i<3; i++) {
-        for (int j=0; j<2; j++) {
-            bboxmin[j] = std::min(bboxmin[j], pts[i][j]/pts[i][3]);
-            bboxmax[j] = std::max(bboxmax[j], pts[i][j]/pts[i][3]);
+        int64_t v = (t.ia[i]/subpixel)*(int64_t(x)*subpixel-t.ox[i]) + (t.ib[i]/subpixel)*(int64_t(y)*subpixel-t.oy[i]) + t.bias[i];
+        e[i] = (int)std::max(-emax, std::min(emax, v));
+    }
+}
+
+// barycentric coordinates of the pixel (x,y)
+Vec3f barycentric(const Setup &t, int x, int y) {
+    Vec3f c;
+    for (int i=0; i<3; i++) c[i] = t.ex[i]*(x-t.o[i].x) + t.ey[i]*(y-t.o[i].y);
+    return c;
+}
+
+// the greatest depth the triangle can have inside the [x0,x1]x[y0,y1] block: z/w is a linear-fractional function of the
+// pixel position, thus it reaches its maximum in a corner of the block (or in a vertex of the triangle); it holds only
+// while w stays positive over the block, a corner beyond the w=0 line leaves the vertex depths as the sole bound
+float depthmax(const Setup &t, int x0, int y0, int x1, int y1) {
+    float ret = -std::numeric_limits<float>::max();
+    for (int k=0; k<4; k++) {
+        Vec3f c = barycentric(t, k&1 ? x1 : x0, k&2 ? y1 : y0);
+        if (t.ws*c<=0) return t.depthmax;
+        ret = std::max(ret, (t.zs*c)/(t.ws*c));
+    }
+    return std::min(ret, t.depthmax);
+}
+
+float difference(const TGAColor &a, const TGAColor &b) {
+    int ret = 0;
+    for (int i=0; i<3; i++) ret = std::max(ret, std::abs(int(const_cast<TGAColor &>(a)[i])-int(const_cast<TGAColor &>(b)[i])));
+    return ret/255.f;
+}
+
+float difference(const Surface &a, const Surface &b) {
+    return std::max(difference(a.albedo, b.albedo), 1.f-a.normal*b.normal);
+}
+
+void setup_face(Vec4f *pts, FaceSetup &face) {
+    Vec4f poly[maxclip];
+    Vec3f bars[maxclip];
+    bool clipped;
+    int n = clip(pts, poly, bars, clipped);
+    face.n = 0;
+    for (int k=1; k+1<n; k++) {
+        Vec4f tri[3]  = { poly[0], poly[k], poly[k+1] };
+        Vec3f tbar[3] = { bars[0], bars[k], bars[k+1] };
+        Vec2f s[3];
+        for (int i=0; i<3; i++) s[i] = proj<2>(tri[i]/tri[i][3]);
+        if (setup(tri, s, clipped ? tbar : NULL, face.t[face.n])) face.n++;
+    }
+}
+
+// the edge functions are linear in x along the row: A*x + B >= 0 is solved for every edge, the fill rule included
+bool row_span(const Setup &t, int y, int xmin, int xmax, int &x0, int &x1) {
+    int64_t lo = xmin, hi = xmax;
+    for (int i=0; i<3; i++) {
+        int64_t A = t.ia[i];
+        int64_t B = (t.ib[i]/subpixel)*(int64_t(y)*subpixel-t.oy[i]) - (t.ia[i]/subpixel)*t.ox[i] + t.bias[i];
+        if (A>0)      lo = std::max(lo, B>=0 ? -(B/A) : (-B+A-1)/A); // ceil(-B/A)
+        else if (A<0) hi = std::min(hi, B>=0 ? B/-A : -((-B-A-1)/-A)); // floor(B/-A)
+        else if (B<0) return false;
+    }
+    x0 = (int)lo;
+    x1 = (int)hi;
+    return lo<=hi;
+}
+
+// the pixel was covered by exactly one triangle of the face, the one whose edge functions are all non negative
+Vec3f face_barycentric(const FaceSetup &face, int x, int y) {
+    int k = 0;
+    for (; k+1<face.n; k++) {
+        int e[3];
+        edges(face.t[k], x, y, e);
+        if ((e[0]|e[1]|e[2])>=0) break;
+    }
+    return perspective(face.t[k].Q*barycentric(face.t[k], x, y));
+}
+
+void triangle(Vec4f *pts, IShader &shader, ColorBuffer &image, DepthBuffer &zbuffer) {
+    triangle<IShader>(pts, shader, image, zbuffer);
+}
+
+void draw(IShader &shader, int nfaces, ColorBuffer &image, DepthBuffer &zbuffer, bool prepass) {
+    draw<IShader>(shader, nfaces, image, zbuffer, prepass);
+}
+
+void draw(IShader &shader, int nfaces, DepthBuffer &zbuffer, bool conservative) {
+    draw<IShader>(shader, nfaces, zbuffer, conservative);
+}
+
+void visualize(const DepthBuffer &zbuffer, ColorBuffer &image) {
+    int ntilesx = (zbuffer.width +tilesize-1)/tilesize;
+    int ntilesy = (zbuffer.height+tilesize-1)/tilesize;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int t=0; t<ntilesx*ntilesy; t++) {
+        if (zbuffer.cleared[t]) continue; // nothing was drawn there
+        image.touch(t);
+        int x0 = (t%ntilesx)*tilesize, y0 = (t/ntilesx)*tilesize;
+        for (int y=y0; y<std::min(y0+tilesize, zbuffer.height); y++)
+            for (int x=x0; x<std::min(x0+tilesize, zbuffer.width); x++)
+                image.data[image.index(x, y)] = pack(TGAColor(255, 255, 255)*(zbuffer.get(x, y)/depth));
+    }
+}
+
+void draw(IShader &shader, int nfaces, MultisampleImage &msimage, DepthBuffer &zbuffer) {
+    draw<IShader>(shader, nfaces, msimage, zbuffer);
+}
+
+// every pixel of the image is written, the cleared tiles of the multisampled image from its clear value
+void resolve(MultisampleImage &msimage, ColorBuffer &image) {
+    int ns = msimage.samples;
+    int ntilesx = (msimage.width +tilesize-1)/tilesize;
+    int ntilesy = (msimage.height+tilesize-1)/tilesize;
+    TGAColor c = unpack(msimage.clearvalue);
+    unsigned int clearcolor = pack(TGAColor(c.bgra[2], c.bgra[1], c.bgra[0]));
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int t=0; t<ntilesx*ntilesy; t++) {
+        image.cleared[t] = 0;
+        if (msimage.cleared[t]) {
+            std::fill(image.data.begin()+t*tilesize*tilesize, image.data.begin()+(t+1)*tilesize*tilesize, clearcolor);
+            continue;
+        }
+        int x0 = (t%ntilesx)*tilesize, y0 = (t/ntilesx)*tilesize;
+        for (int y=y0; y<std::min(y0+tilesize, msimage.height); y++) {
+            for (int x=x0; x<std::min(x0+tilesize, msimage.width); x++) {
+                int sum[3] = {0, 0, 0};
+                const unsigned char *samples = reinterpret_cast<const unsigned char *>(&msimage.data[msimage.index(x, y)]);
+                for (int k=0; k<ns; k++)
+                    for (int i=0; i<3; i++) sum[i] += samples[k*4+i];
+                image.data[image.index(x, y)] = pack(TGAColor((sum[2]+ns/2)/ns, (sum[1]+ns/2)/ns, (sum[0]+ns/2)/ns));
+            }
         }
     }
-    Vec2i P;
-    TGAColor color;
-    for (P.x=bboxmin.x; P.x<=bboxmax.x; P.x++) {
-        for (P.y=bboxmin.y; P.y<=bboxmax.y; P.y++) {
-            Vec3f c = barycentric(proj<2>(pts[0]/pts[0][3]), proj<2>(pts[1]/pts[1][3]), proj<2>(pts[2]/pts[2][3]), proj<2>(P));
-            float z = pts[0][2]*c.x + pts[1][2]*c.y + pts[2][2]*c.z;
-            float w = pts[0][3]*c.x + pts[1][3]*c.y + pts[2][3]*c.z;
-            int frag_depth = z/w;
-            if (c.x<0 || c.y<0 || c.z<0 || zbuffer[P.x+P.y*image.get_width()]>frag_depth) continue;
-            bool discard = shader.fragment(c, color);
-            if (!discard) {
-                zbuffer[P.x+P.y*image.get_width()] = frag_depth;
-                image.set(P.x, P.y, color);
+}
+
+void draw(IShader &shader, int nfaces, OITBuffer &oit, DepthBuffer &zbuffer) {
+    draw<IShader>(shader, nfaces, oit, zbuffer);
+}
+
+// back to front compositing: from the farthest layer, each nearer one goes over the result, which ends over the opaque
+// color; the tiles without any transparent fragment are skipped
+void resolve(OITBuffer &oit, ColorBuffer &image) {
+    int ntilesx = (oit.width +tilesize-1)/tilesize;
+    int ntilesy = (oit.height+tilesize-1)/tilesize;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int t=0; t<ntilesx*ntilesy; t++) {
+        if (oit.cleared[t]) continue;
+        image.touch(t);
+        int x0 = (t%ntilesx)*tilesize, y0 = (t/ntilesx)*tilesize;
+        for (int y=y0; y<std::min(y0+tilesize, oit.height); y++) {
+            for (int x=x0; x<std::min(x0+tilesize, oit.width); x++) {
+                int i = oit.index(x, y);
+                if (!oit.counts[i]) continue;
+                TGAColor color = unpack(oit.colors[i*oit.layers+oit.counts[i]-1]);
+                for (int k=oit.counts[i]-2; k>=0; k--) color = over(unpack(oit.colors[i*oit.layers+k]), color);
+                TGAColor background = unpack(image.data[i]);
+                background.bgra[3] = 255; // the opaque color
+                color = over(color, background);
+                image.data[i] = pack(color);
             }
         }
     }
 }
 
+void draw(int drawid, IShader &shader, int nfaces, VisibilityBuffer &vbuffer, DepthBuffer &zbuffer) {
+    draw<IShader>(drawid, shader, nfaces, vbuffer, zbuffer);
+}
+
+void resolve(IShader &shader, int drawid, VisibilityBuffer &vbuffer, ColorBuffer &image, const ShadingRates *rates) {
+    resolve<IShader>(shader, drawid, vbuffer, image, rates);
+}
+
+void resolve(IShader &shader, int drawid, VisibilityBuffer &vbuffer, GBuffer &gbuffer, const ShadingRates *rates) {
+    resolve<IShader>(shader, drawid, vbuffer, gbuffer, rates);
+}
+
+void relight(ILighting &lighting, GBuffer &gbuffer, ColorBuffer &image) {
+    relight<ILighting>(lighting, gbuffer, image);
+}
+
+void scanline(IShader &shader, int nfaces, int width, int height, IRowOutput &out) {
+    scanline<IShader>(shader, nfaces, width, height, out);
+}
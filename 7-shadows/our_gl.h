@@ -1,23 +1,274 @@
 #ifndef __OUR_GL_H__
 #define __OUR_GL_H__
+#include <vector>
+#include <algorithm>
+#include <cstring>
 #include "tgaimage.h"
 #include "geometry.h"
 
 extern Matrix ModelView;
 extern Matrix Viewport;
 extern Matrix Projection;
+
+enum CullMode { CULL_NONE, CULL_BACK, CULL_FRONT };
+extern CullMode Culling;
+
+// the blend stage of the color writes of triangle() and draw(), per sample for the multisampled targets. The fragment
+// colors are premultiplied by their alpha: over is src + dst*(1-src.a), add is src + dst (saturated), multiply is
+// src*dst; BLEND_NONE overwrites the color
+enum BlendMode { BLEND_NONE, BLEND_OVER, BLEND_ADD, BLEND_MULTIPLY };
+extern BlendMode Blending;
+
 const float depth = 2000.f;
+const float intrange = 2e9f; // the float depths are truncated to int, the greater ones (extrapolated bounds) saturate
+const int tilesize = 64; // screen tile size used by draw() for the binning
+const int hizsize  = 8;  // block size of the coarse depth buffer
+const int batchsize = hizsize; // max number of fragments shaded by a single IShader::fragments() call
 
 void viewport(int x, int y, int w, int h);
 void projection(float coeff=0.f); // coeff = -1/c
 void lookat(Vec3f eye, Vec3f center, Vec3f up);
+void cull(CullMode mode); // the faces are counterclockwise when seen from the front
+void blend(BlendMode mode);
+
+// the render targets are stored by tiles of tilesize x tilesize pixels, row by row inside a tile: the pixels of a binned
+// tile are contiguous in memory, and so are the pixels of a span. The buffers are padded to whole tiles
+inline int tiled(int x, int y, int width) {
+    int ntilesx = (width+tilesize-1)/tilesize;
+    return ((y/tilesize)*ntilesx + x/tilesize)*tilesize*tilesize + (y%tilesize)*tilesize + x%tilesize;
+}
+
+inline int padded(int w, int h) { // the number of pixels of a tiled buffer
+    return (w+tilesize-1)/tilesize*tilesize * ((h+tilesize-1)/tilesize*tilesize);
+}
+
+inline int ntiles(int w, int h) {
+    return (w+tilesize-1)/tilesize * ((h+tilesize-1)/tilesize);
+}
+
+// Fast clear: clear() only flags the tiles, a flagged tile holds the clear value whatever its memory is. The memory of a
+// tile is filled by touch(), the renderer calls it before the first write to the tile; the tiles no face touches are
+// never filled. The buffers are constructed cleared
+
+// tiled color target, the bgra bytes of a pixel are packed in an unsigned int; untile() copies it to an image
+struct ColorBuffer {
+    int width, height;
+    std::vector<unsigned int> data;
+    std::vector<unsigned char> cleared; // per tile
+    unsigned int clearvalue;
+
+    ColorBuffer(int w, int h);
+    int index(int x, int y) const { return tiled(x, y, width); }
+    TGAColor get(int x, int y) const;
+    void set(int x, int y, const TGAColor &color);
+    void clear(const TGAColor &color=TGAColor(0, 0, 0, 0));
+    void touch(int tile);
+};
+
+inline unsigned int pack(const TGAColor &color) {
+    unsigned int v;
+    memcpy(&v, color.bgra, 4);
+    return v;
+}
+
+void untile(const ColorBuffer &buffer, TGAImage &image);
+
+// depth storage formats: the unorm formats keep depth/(2^n-1) steps of the fragment depth in [0, depth], the triangles
+// are clipped to this range before they reach them, the 24 bit values are stored in 32 bit words
+enum DepthFormat { DEPTH_FLOAT32, DEPTH_UNORM24, DEPTH_UNORM16 };
+
+// the greater the depth, the closer the fragment; along with the per pixel depth the buffer keeps the farthest depth of
+// every hizsize x hizsize block, it allows the rasterizer to reject whole blocks of a triangle before any per pixel work.
+// A multisampled buffer keeps the depth of every sample, the samples of a pixel are consecutive. The rasterizer works in
+// the stored units: the fragment depths are quantized before the depth test, the coarse depths are stored units as well
+struct DepthBuffer {
+    int width, height, samples;
+    DepthFormat format;
+    float scale;    // stored value = fragment depth*scale, rounded and clamped to [0, maxvalue] for the unorm formats,
+                    // the integer part of the depth, within [-intrange, intrange], for the float format
+    float maxvalue;
+    int coarse_width, coarse_height;
+    std::vector<float> data;            // the storage of the format in use, the two others are empty
+    std::vector<unsigned int> data24;
+    std::vector<unsigned short> data16;
+    std::vector<float> coarse;
+    std::vector<unsigned char> cleared; // per tile
+    float clearvalue; // the farthest depth, in stored units
+
+    DepthBuffer(int w, int h, int samples=1, DepthFormat format=DEPTH_FLOAT32);
+    int index(int x, int y) const { return tiled(x, y, width)*samples; } // the first sample of the pixel
+    float get(int x, int y) const; // the depth of the first sample of the pixel
+    void update_coarse(int bx, int by); // to be called after the pixels of the block (bx,by) were written
+    void clear();
+    void touch(int tile);
+
+    float quantize(float d) const {
+        if (format==DEPTH_FLOAT32) return float(int(std::min(std::max(d, -intrange), intrange)));
+        return float(int(std::min(std::max(d*scale, 0.f), maxvalue)+.5f));
+    }
+    float load(int i) const {
+        return format==DEPTH_FLOAT32 ? data[i] : format==DEPTH_UNORM24 ? float(data24[i]) : float(data16[i]);
+    }
+    void store(int i, float v) { // v is a quantized value
+        if (format==DEPTH_FLOAT32) data[i] = v;
+        else if (format==DEPTH_UNORM24) data24[i] = (unsigned int)v;
+        else data16[i] = (unsigned short)v;
+    }
+};
+
+// multisampled color buffer: it is rendered with a multisampled DepthBuffer, the coverage and the depth test are done per
+// sample while the fragment shader runs once per pixel and triangle, its color goes to the samples the triangle covers
+const int maxsamples = 8;
+
+struct MultisampleImage {
+    int width, height, samples;     // 4 or 8 samples per pixel
+    std::vector<unsigned int> data; // packed colors, the samples of a pixel are consecutive
+    std::vector<unsigned char> cleared; // per tile
+    unsigned int clearvalue;
+
+    MultisampleImage(int w, int h, int samples);
+    int index(int x, int y) const { return tiled(x, y, width)*samples; }
+    void clear(const TGAColor &color=TGAColor(0, 0, 0, 0));
+    void touch(int tile);
+};
+
+// visibility buffer: the id of the face seen by every pixel, the draw id in the upper bits and the face index in the lower ones
+const int faceidbits = 24;
+const unsigned int facemask  = (1u<<faceidbits)-1;
+const unsigned int novisible = 0xffffffff;
+
+struct VisibilityBuffer {
+    int width, height;
+    std::vector<unsigned int> ids;
+    std::vector<unsigned char> cleared; // per tile, a cleared tile is novisible
+
+    VisibilityBuffer(int w, int h);
+    int index(int x, int y) const { return tiled(x, y, width); }
+    void clear();
+    void touch(int tile);
+};
+
+// order independent transparency: the transparent fragments passing the depth test against the zbuffer of the opaque
+// faces are kept per pixel, up to layers of them sorted from the nearest to the farthest; a pixel overflowing its layers
+// merges the two farthest ones (multi-layer alpha blending), thus the memory is fixed and the nearest layers stay exact.
+// The alpha of the fragment colors is their opacity, the colors are premultiplied by it as in the blend stage
+const int maxlayers = 8;
+
+struct OITBuffer {
+    int width, height, layers;
+    std::vector<unsigned int> colors; // packed colors, the layers of a pixel are consecutive
+    std::vector<float> depths;
+    std::vector<unsigned char> counts;
+    std::vector<unsigned char> cleared; // per tile, a cleared pixel holds no fragment
+
+    OITBuffer(int w, int h, int layers=4);
+    int index(int x, int y) const { return tiled(x, y, width); }
+    void insert(int i, float d, const TGAColor &color); // adds a fragment of depth d to the pixel of index i
+    void clear();
+    void touch(int tile);
+};
+
+// G-buffer: the surface attributes of every pixel, the lighting can be re-run on them without rasterizing the scene again
+struct Surface {
+    Vec3f position; // the space is up to the shaders, it is the one the lighting works in
+    Vec3f normal;
+    TGAColor albedo;
+    float specular;
+
+    Surface() : position(), normal(), albedo(), specular(0) {}
+};
+
+struct GBuffer {
+    int width, height;
+    std::vector<Surface> data;
+    std::vector<unsigned char> covered; // the pixels holding a surface
+    std::vector<unsigned char> cleared; // per tile, a cleared tile covers no pixel
+
+    GBuffer(int w, int h);
+    void clear();
+    void touch(int tile);
+};
+
+// variable rate shading of the resolve: the coverage and the depth stay per pixel, they come from the visibility buffer,
+// while the shader runs once per rate x rate block of pixels of the same face and its result is broadcast to the block.
+// RATE_AUTO shades a 4x4 block of a single face twice and keeps the two samples if they differ by less than the threshold
+// (the max channel difference of the colors; of the albedos or the normals for the G-buffer), it falls back to 1x1 otherwise
+enum ShadingRate { RATE_AUTO=0, RATE_1X1=1, RATE_2X2=2, RATE_4X4=4 };
+
+struct ShadingRates {
+    int ntilesx, ntilesy;         // the rates are set per screen tile of tilesize x tilesize pixels
+    float threshold;
+    std::vector<ShadingRate> rates;
+
+    ShadingRates(int w, int h, ShadingRate rate=RATE_1X1, float threshold=.03f); // a single rate for the whole draw
+    void set(int x0, int y0, int x1, int y1, ShadingRate rate); // the rate of the tiles touching the pixels [x0,x1]x[y0,y1]
+};
 
 struct IShader {
     virtual ~IShader();
+    virtual IShader *clone() const = 0; // draw() renders the tiles in parallel, every thread works on its own copy
     virtual Vec4f vertex(int iface, int nthvert) = 0;
-    virtual bool fragment(Vec3f bar, TGAColor &color) = 0;
+    virtual bool fragment(Vec3f bar, TGAColor &color) = 0; // returns true if the fragment is discarded
+    // a batch of fragments of a span, the i-th one is to be shaded iff the i-th bit of the mask is set; returns the mask of
+    // the fragments that were not discarded. Defaults to a fragment() call per fragment, override it to share the work
+    virtual int fragments(const Vec3f *bar, int mask, TGAColor *colors);
+    // deferred shading: the surface attributes of the fragment, returns true if discarded. Defaults to discarding everything
+    virtual bool surface(Vec3f bar, Surface &s);
+};
+
+// deferred lighting of the G-buffer; it only reads its uniforms, a single instance is shared by all the threads
+struct ILighting {
+    virtual ~ILighting();
+    virtual TGAColor light(const Surface &s) = 0;
 };
 
-void triangle(Vec4f *pts, IShader &shader, TGAImage &image, float *zbuffer);
+// receives the rows of the scanline renderer, from the bottom one up
+struct IRowOutput {
+    virtual ~IRowOutput();
+    virtual void row(int y, const TGAColor *colors) = 0; // the width colors of the row y
+};
+
+void triangle(Vec4f *pts, IShader &shader, ColorBuffer &image, DepthBuffer &zbuffer);
+// renders the faces [0, nfaces) of the shader; with the depth prepass the fragment shader runs once per visible pixel,
+// it requires a shader that does not discard fragments
+void draw(IShader &shader, int nfaces, ColorBuffer &image, DepthBuffer &zbuffer, bool prepass=false);
+// depth only rendering, e.g. the shadow maps: the fragment shader is not run, there is no color target. The conservative
+// rasterization covers every pixel the triangle touches, not only the pixels whose center it contains: the thin faces stay
+// watertight in a low resolution buffer, the depths are clamped to the nearest one of the triangle
+void draw(IShader &shader, int nfaces, DepthBuffer &zbuffer, bool conservative=false);
+void visualize(const DepthBuffer &zbuffer, ColorBuffer &image); // gray levels of the depths, for debugging
+// multisample anti-aliasing, the resolve averages the samples of every pixel to the color buffer
+void draw(IShader &shader, int nfaces, MultisampleImage &msimage, DepthBuffer &zbuffer);
+void resolve(MultisampleImage &msimage, ColorBuffer &image);
+// transparent faces, drawn after the opaque ones: the zbuffer is tested but not written, the fragments go to the OIT
+// buffer, then the resolve composites them over the opaque color
+void draw(IShader &shader, int nfaces, OITBuffer &oit, DepthBuffer &zbuffer);
+void resolve(OITBuffer &oit, ColorBuffer &image);
+
+// visibility buffer rendering: the draw rasterizes the faces to the face ids and the depth only, then the resolve runs the
+// fragment shader once per pixel of the given draw (a single fragment() call per pixel, whatever the overdraw was)
+void draw(int drawid, IShader &shader, int nfaces, VisibilityBuffer &vbuffer, DepthBuffer &zbuffer);
+void resolve(IShader &shader, int drawid, VisibilityBuffer &vbuffer, ColorBuffer &image, const ShadingRates *rates=NULL);
+// deferred shading: the resolve writes the surface attributes only, then every relight() call lights all the covered pixels
+void resolve(IShader &shader, int drawid, VisibilityBuffer &vbuffer, GBuffer &gbuffer, const ShadingRates *rates=NULL);
+void relight(ILighting &lighting, GBuffer &gbuffer, ColorBuffer &image);
+// scanline hidden surface removal without any frame sized buffer: an active face table is walked row by row, every row
+// is resolved with a one row depth buffer, shaded and handed to the output as soon as it is done. The memory depends on
+// the width and on the number of faces only. As with the visibility buffer, the shader must not discard fragments
+void scanline(IShader &shader, int nfaces, int width, int height, IRowOutput &out);
+
+// same as above, specialized at compile time for a concrete shader type
+template <typename ShaderT> void triangle(Vec4f *pts, ShaderT &shader, ColorBuffer &image, DepthBuffer &zbuffer);
+template <typename ShaderT> void draw(ShaderT &shader, int nfaces, ColorBuffer &image, DepthBuffer &zbuffer, bool prepass=false);
+template <typename ShaderT> void draw(ShaderT &shader, int nfaces, DepthBuffer &zbuffer, bool conservative=false);
+template <typename ShaderT> void draw(ShaderT &shader, int nfaces, MultisampleImage &msimage, DepthBuffer &zbuffer);
+template <typename ShaderT> void draw(ShaderT &shader, int nfaces, OITBuffer &oit, DepthBuffer &zbuffer);
+template <typename ShaderT> void draw(int drawid, ShaderT &shader, int nfaces, VisibilityBuffer &vbuffer, DepthBuffer &zbuffer);
+template <typename ShaderT> void resolve(ShaderT &shader, int drawid, VisibilityBuffer &vbuffer, ColorBuffer &image, const ShadingRates *rates=NULL);
+template <typename ShaderT> void resolve(ShaderT &shader, int drawid, VisibilityBuffer &vbuffer, GBuffer &gbuffer, const ShadingRates *rates=NULL);
+template <typename LightingT> void relight(LightingT &lighting, GBuffer &gbuffer, ColorBuffer &image);
+template <typename ShaderT> void scanline(ShaderT &shader, int nfaces, int width, int height, IRowOutput &out);
+
+#include "rasterizer.h"
 #endif //__OUR_GL_H__
 
@@ -0,0 +1,972 @@
+#ifndef __RASTERIZER_H__
+#define __RASTERIZER_H__
+#include <vector>
+#include <algorithm>
+#include <limits>
+#include <cassert>
+#include <stdint.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "our_gl.h"
+
+// The rasterizer is templated over the shader type: the calls to a concrete shader are qualified, thus bound at compile
+// time and inlined into the raster loops; the IShader instantiation is the one going through the virtual functions.
+
+const int subpixel = 16; // vertices are snapped to the 28.4 fixed point grid
+const int maxclip  = 10; // a triangle clipped by the near plane, the guard band and the depth range has at most 10 vertices
+const int maxrate  = 4;  // the coarsest shading rate, RATE_AUTO works on blocks of this size
+const int smallsize = 8; // the triangles whose bbox fits in smallsize x smallsize pixels take the fast path of fill()
+
+// what the rasterizer does with the covered pixels
+enum RasterMode {
+    RASTER_SHADE,      // depth test, shading, depth and color writes
+    RASTER_DEPTH,      // depth test and depth writes only, the fragment shader is not run
+    RASTER_SHADE_EQUAL, // shading of the pixels whose depth equals the zbuffer (filled by RASTER_DEPTH), color writes only
+    RASTER_VISIBILITY,  // depth test, depth and visibility id writes, the fragment shader is not run
+    RASTER_MULTISAMPLE, // depth test per sample, shading per pixel, depth and color writes of the passing samples
+    RASTER_TRANSPARENT, // depth test, shading, the fragments go to the OIT buffer, no depth writes
+    RASTER_CONSERVATIVE // RASTER_DEPTH with the conservative coverage: every pixel the triangle touches is covered
+};
+
+// the render targets of a raster pass
+struct Target {
+    RasterMode mode;
+    ColorBuffer *image;
+    DepthBuffer *zbuffer;
+    VisibilityBuffer *vbuffer;
+    unsigned int id; // the visibility id of the face being rasterized
+    MultisampleImage *msimage;
+    OITBuffer *oit;
+};
+
+// per triangle constants of the rasterizer
+struct Setup {
+    // coverage: fixed point edge functions E_i(x,y) = ia[i]*x + ib[i]*y + const, the pixel is covered iff all three are
+    // non negative; the values are oriented to be positive inside and biased by -1 on the edges not owned by the triangle
+    int ia[3], ib[3];
+    int64_t ox[3], oy[3]; // 28.4 coordinates of a point of every edge, E_i is evaluated relative to it
+    int64_t bias[3];
+    // interpolation: the i-th barycentric coordinate of the pixel P is ex[i]*(P.x-o[i].x) + ey[i]*(P.y-o[i].y)
+    Vec3f ex, ey;
+    Vec2f o[3];
+    Vec3f zs, ws;    // z and w of the vertices, they are linear in the (screen) barycentric coordinates
+    // perspective correction: q = Q*c is linear in screen space, Q = B*diag(1/w) with B mapping the barycentric coordinates
+    // of a part of a clipped triangle to the original ones (the identity otherwise), q/(q[0]+q[1]+q[2]) are the perspective
+    // correct coordinates with respect to the original face
+    mat<3,3,float> Q;
+    Vec3f qx;        // q increments along x
+    float zx, wx;    // z and w increments along x
+    float depthmax;  // the greatest z/w of the triangle
+    float zmax;      // the fragment depths are clamped to it, see setup()
+#ifdef __SSE2__
+    __m128i ia4[3], istep4[3];                          // lane offsets and 4 pixel steps of the edge functions
+    __m128 qx4[3], qstep4[3], zx4, zstep4, wx4, wstep4; // lane offsets and 4 pixel steps of the interpolated values
+    __m128 zmax4;
+#endif
+
+    Setup() : ex(), ey(), zs(), ws(), Q(), qx(), zx(0), wx(0), depthmax(0), zmax(0)
+#ifdef __SSE2__
+        , zx4(), zstep4(), wx4(), wstep4(), zmax4()
+#endif
+    {}
+};
+
+bool culled(Vec4f *pts); // the cull stage: back/front facing (see cull()) and zero area triangles
+int clip(Vec4f *pts, Vec4f *poly, Vec3f *bars, bool &clipped, bool depthrange=false); // near plane, guard band and depth range clipping
+bool bbox(Vec2f *s, int n, Vec2i rmin, Vec2i rmax, Vec2i &bboxmin, Vec2i &bboxmax, int margin=0);
+bool face_bbox(Vec4f *pts, Vec2i rmin, Vec2i rmax, Vec2i &bboxmin, Vec2i &bboxmax, int margin=0, bool depthrange=false); // bbox of the clipped face
+bool setup(Vec4f *pts, Vec2f *s, Vec3f *bars, Setup &t, bool conservative=false); // false for the degenerate triangles
+void edges(const Setup &t, int x, int y, int *e);
+Vec3f barycentric(const Setup &t, int x, int y);
+
+// perspective correct barycentric coordinates (with respect to the original face) from the interpolated q (see Setup)
+inline Vec3f perspective(Vec3f q) {
+    return q/(q[0]+q[1]+q[2]);
+}
+float depthmax(const Setup &t, int x0, int y0, int x1, int y1);
+
+// the offsets of the samples of a pixel relative to its center: edge functions, q (see Setup), z and w
+struct SampleSetup {
+    int e[maxsamples][3];
+    Vec3f q[maxsamples];
+    float z[maxsamples], w[maxsamples];
+};
+void setup_samples(const Setup &t, int samples, SampleSetup &ss);
+
+// the screen space setup of a whole face, it gives back the barycentric coordinates of the pixels in the shading pass
+struct FaceSetup {
+    int n;                  // number of triangles, more than one if the face was clipped
+    Setup t[maxclip-2];
+
+    FaceSetup() : n(0) {}
+};
+void setup_face(Vec4f *pts, FaceSetup &face);
+bool row_span(const Setup &t, int y, int xmin, int xmax, int &x0, int &x1);
+Vec3f face_barycentric(const FaceSetup &face, int x, int y);
+
+// the difference of two shading results, RATE_AUTO compares it to the threshold
+float difference(const TGAColor &a, const TGAColor &b);
+float difference(const Surface &a, const Surface &b);
+
+template <typename ShaderT> ShaderT *copy_shader(const ShaderT &shader) {
+    return new ShaderT(shader);
+}
+
+template <typename ShaderT> Vec4f shade_vertex(ShaderT &shader, int iface, int nthvert) {
+    return shader.ShaderT::vertex(iface, nthvert);
+}
+
+template <typename ShaderT> int shade_fragments(ShaderT &shader, const Vec3f *bar, int mask, TGAColor *colors) {
+    return shader.ShaderT::fragments(bar, mask, colors);
+}
+
+template <typename ShaderT> bool shade_surface(ShaderT &shader, Vec3f bar, Surface &s) {
+    return shader.ShaderT::surface(bar, s);
+}
+
+template <typename LightingT> TGAColor light_surface(LightingT &lighting, const Surface &s) {
+    return lighting.LightingT::light(s);
+}
+
+template <> inline IShader *copy_shader<IShader>(const IShader &shader) {
+    return shader.clone();
+}
+
+template <> inline Vec4f shade_vertex<IShader>(IShader &shader, int iface, int nthvert) {
+    return shader.vertex(iface, nthvert);
+}
+
+template <> inline int shade_fragments<IShader>(IShader &shader, const Vec3f *bar, int mask, TGAColor *colors) {
+    return shader.fragments(bar, mask, colors);
+}
+
+template <> inline bool shade_surface<IShader>(IShader &shader, Vec3f bar, Surface &s) {
+    return shader.surface(bar, s);
+}
+
+template <> inline TGAColor light_surface<ILighting>(ILighting &lighting, const Surface &s) {
+    return lighting.light(s);
+}
+
+// a block of pixels against the triangle, e being the edge functions at its top left pixel and (w+1)x(h+1) its size;
+// the edge functions are linear, the extreme values over the block are found at its corners
+enum { BLOCK_OUTSIDE, BLOCK_PARTIAL, BLOCK_INSIDE };
+
+inline int classify(const Setup &t, const int *e, int w, int h) {
+    bool inside = true;
+    for (int i=0; i<3; i++) {
+        int dx = t.ia[i]*w, dy = t.ib[i]*h;
+        if (e[i] + std::max(dx, 0) + std::max(dy, 0)<0) return BLOCK_OUTSIDE;
+        inside &= e[i] + std::min(dx, 0) + std::min(dy, 0)>=0;
+    }
+    return inside ? BLOCK_INSIDE : BLOCK_PARTIAL;
+}
+
+#ifdef __SSE2__
+// perspective correction of 4 lanes of q at once, the passing lanes are stored to bars
+inline void perspective4(const __m128 *q4, int pass, Vec3f *bars) {
+    __m128 r = _mm_div_ps(_mm_set1_ps(1.f), _mm_add_ps(_mm_add_ps(q4[0], q4[1]), q4[2]));
+    float b[3][4];
+    for (int i=0; i<3; i++) _mm_storeu_ps(b[i], _mm_mul_ps(q4[i], r));
+    for (int k=0; k<4; k++)
+        if (pass>>k & 1) bars[k] = Vec3f(b[0][k], b[1][k], b[2][k]);
+}
+#endif
+
+#ifdef __SSE2__
+// the 4 stored depths from the index i on, in the stored units
+inline __m128 load4(const DepthBuffer &zbuffer, int i) {
+    switch (zbuffer.format) {
+    case DEPTH_UNORM24: return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)&zbuffer.data24[i]));
+    case DEPTH_UNORM16: return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)&zbuffer.data16[i]), _mm_setzero_si128()));
+    default: return _mm_loadu_ps(&zbuffer.data[i]);
+    }
+}
+
+// 4 fragment depths in the stored units, the same operations as in DepthBuffer::quantize()
+inline __m128 quantize4(const DepthBuffer &zbuffer, __m128 d) {
+    if (zbuffer.format==DEPTH_FLOAT32) return _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(d, _mm_set1_ps(-intrange)), _mm_set1_ps(intrange))));
+    __m128 v = _mm_min_ps(_mm_max_ps(_mm_mul_ps(d, _mm_set1_ps(zbuffer.scale)), _mm_setzero_ps()), _mm_set1_ps(zbuffer.maxvalue));
+    return _mm_cvtepi32_ps(_mm_cvttps_epi32(_mm_add_ps(v, _mm_set1_ps(.5f))));
+}
+
+// stores the lanes of the mask of 4 quantized depths from the index i on, the other lanes keep their values
+inline void store4(DepthBuffer &zbuffer, int i, __m128 d, int mask) {
+    const __m128i bits = _mm_set_epi32(8, 4, 2, 1);
+    __m128i m = _mm_cmpeq_epi32(_mm_and_si128(_mm_set1_epi32(mask), bits), bits);
+    if (zbuffer.format==DEPTH_FLOAT32) {
+        __m128 old = _mm_loadu_ps(&zbuffer.data[i]);
+        _mm_storeu_ps(&zbuffer.data[i], _mm_or_ps(_mm_and_ps(_mm_castsi128_ps(m), d), _mm_andnot_ps(_mm_castsi128_ps(m), old)));
+        return;
+    }
+    __m128i v = _mm_cvttps_epi32(d);
+    if (zbuffer.format==DEPTH_UNORM24) {
+        __m128i old = _mm_loadu_si128((const __m128i *)&zbuffer.data24[i]);
+        _mm_storeu_si128((__m128i *)&zbuffer.data24[i], _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, old)));
+        return;
+    }
+    // the unsigned 16 bit values are packed with a signed saturation, the bias keeps them in range
+    const __m128i bias = _mm_set1_epi32(32768);
+    v = _mm_xor_si128(_mm_packs_epi32(_mm_sub_epi32(v, bias), _mm_setzero_si128()), _mm_set1_epi16(-32768));
+    m = _mm_packs_epi32(m, _mm_setzero_si128());
+    __m128i old = _mm_loadl_epi64((const __m128i *)&zbuffer.data16[i]);
+    _mm_storel_epi64((__m128i *)&zbuffer.data16[i], _mm_or_si128(_mm_and_si128(m, v), _mm_andnot_si128(m, old)));
+}
+#endif
+
+// x*y/255 of two bytes, rounded
+inline int mul255(int x, int y) {
+    int p = x*y + 128;
+    return (p + (p>>8))>>8;
+}
+
+#ifdef __SSE2__
+// same as above on 16 bit lanes
+inline __m128i mul255(__m128i x, __m128i y) {
+    __m128i p = _mm_add_epi16(_mm_mullo_epi16(x, y), _mm_set1_epi16(128));
+    return _mm_srli_epi16(_mm_add_epi16(p, _mm_srli_epi16(p, 8)), 8);
+}
+
+// the blend stage of 4 packed pixels
+inline __m128i blend4(__m128i src, __m128i dst, BlendMode mode) {
+    if (mode==BLEND_ADD) return _mm_adds_epu8(src, dst);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i d[2] = { _mm_unpacklo_epi8(dst, zero), _mm_unpackhi_epi8(dst, zero) };
+    __m128i s[2] = { _mm_unpacklo_epi8(src, zero), _mm_unpackhi_epi8(src, zero) };
+    for (int h=0; h<2; h++) {
+        if (mode==BLEND_MULTIPLY) {
+            d[h] = mul255(s[h], d[h]);
+            continue;
+        }
+        __m128i alpha = _mm_shufflehi_epi16(_mm_shufflelo_epi16(s[h], 0xff), 0xff); // the alpha of each pixel in its 4 lanes
+        d[h] = mul255(d[h], _mm_sub_epi16(_mm_set1_epi16(255), alpha));
+    }
+    __m128i ret = _mm_packus_epi16(d[0], d[1]);
+    return mode==BLEND_OVER ? _mm_adds_epu8(src, ret) : ret;
+}
+#endif
+
+// blends the n packed colors of src into dst (n is a multiple of 4)
+inline void blend_row(unsigned int *dst, const unsigned int *src, int n, BlendMode mode) {
+#ifdef __SSE2__
+    for (int i=0; i<n; i+=4) {
+        __m128i v = blend4(_mm_loadu_si128((const __m128i *)(src+i)), _mm_loadu_si128((const __m128i *)(dst+i)), mode);
+        _mm_storeu_si128((__m128i *)(dst+i), v);
+    }
+#else
+    for (int i=0; i<n; i++) {
+        const unsigned char *s = reinterpret_cast<const unsigned char *>(src+i);
+        unsigned char *d = reinterpret_cast<unsigned char *>(dst+i);
+        for (int c=0; c<4; c++) {
+            int v = mode==BLEND_ADD ? s[c]+d[c] : mode==BLEND_MULTIPLY ? mul255(s[c], d[c]) : s[c]+mul255(d[c], 255-s[3]);
+            d[c] = std::min(v, 255);
+        }
+    }
+#endif
+}
+
+// writes the fragments of the mask found in the row y from x0 on: the depth and the visibility id, or the shading and the
+// color (or the OIT layer); fd and bars hold their depths and barycentric coordinates. Returns true if the zbuffer was written
+template <typename ShaderT> bool commit(int y, int x0, int mask, const float *fd, const Vec3f *bars, ShaderT &shader, Target &target) {
+    RasterMode mode = target.mode;
+    DepthBuffer &zbuffer = *target.zbuffer;
+    int row = zbuffer.index(x0, y)-x0; // the span lies inside a tile, its pixels are contiguous
+    if (mode==RASTER_DEPTH || mode==RASTER_CONSERVATIVE || mode==RASTER_VISIBILITY) {
+        for (int i=0; i<batchsize; i++) {
+            if (!(mask>>i & 1)) continue;
+            zbuffer.store(row+x0+i, fd[i]);
+            if (mode==RASTER_VISIBILITY) target.vbuffer->ids[target.vbuffer->index(x0, y)+i] = target.id;
+        }
+        return true;
+    }
+
+    TGAColor colors[batchsize];
+    mask = shade_fragments(shader, bars, mask, colors);
+    if (mode==RASTER_TRANSPARENT) {
+        int p = target.oit->index(x0, y);
+        for (int i=0; i<batchsize; i++)
+            if (mask>>i & 1) target.oit->insert(p+i, fd[i], colors[i]);
+        return false;
+    }
+    unsigned int *pixels = &target.image->data[target.image->index(x0, y)];
+    unsigned int src[batchsize], dst[batchsize];
+    for (int i=0; i<batchsize; i++) {
+        src[i] = dst[i] = 0;
+        if (!(mask>>i & 1)) continue;
+        if (mode==RASTER_SHADE) zbuffer.store(row+x0+i, fd[i]);
+        src[i] = pack(colors[i]);
+        dst[i] = pixels[i];
+    }
+    if (Blending!=BLEND_NONE) blend_row(dst, src, batchsize, Blending); // on the span copy, the pixels out of the mask stay untouched
+    for (int i=0; i<batchsize; i++)
+        if (mask>>i & 1) pixels[i] = Blending==BLEND_NONE ? src[i] : dst[i];
+    return mode==RASTER_SHADE && mask;
+}
+
+// rasterizes the pixels [x0, x1] of the row y, e being the edge functions at (x0,y); returns true if the zbuffer was written.
+// The span is at most batchsize pixels long, its fragments passing the depth test are shaded with a single fragments() call.
+// An inside span is known to be covered by the triangle, the coverage tests are skipped
+template <typename ShaderT> bool span(const Setup &t, int y, int x0, int x1, const int *e, ShaderT &shader, Target &target, bool inside=false) {
+    RasterMode mode = target.mode;
+    bool shading = mode==RASTER_SHADE || mode==RASTER_SHADE_EQUAL || mode==RASTER_TRANSPARENT;
+    Vec3f bars[batchsize];
+    float fd[batchsize];
+    int mask = 0;
+    bool written = false;
+    DepthBuffer &zbuffer = *target.zbuffer;
+    int row = zbuffer.index(x0, y)-x0;
+    int x = x0;
+    int e0 = e[0], e1 = e[1], e2 = e[2];
+    Vec3f c = barycentric(t, x, y); // the only full evaluation per span, then we walk along it with adds
+    Vec3f q = t.Q*c;
+    float z = t.zs*c, w = t.ws*c;
+#ifdef __SSE2__
+    // 4 pixels at once: coverage, depth and depth test are evaluated with masks, the passing lanes go to the batch
+    bool depthonly = mode==RASTER_DEPTH || mode==RASTER_CONSERVATIVE;
+    __m128i e4[3];
+    __m128 q4[3];
+    for (int i=0; i<3; i++) {
+        e4[i] = _mm_add_epi32(_mm_set1_epi32(e[i]), t.ia4[i]);
+        q4[i] = _mm_add_ps(_mm_set1_ps(q[i]), t.qx4[i]);
+    }
+    __m128 z4 = _mm_add_ps(_mm_set1_ps(z), t.zx4);
+    __m128 w4 = _mm_add_ps(_mm_set1_ps(w), t.wx4);
+    for (; x+3<=x1; x+=4) {
+        // a pixel is outside iff the sign bit of one of its edge functions is set
+        int outside = inside ? 0 : _mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_or_si128(e4[0], e4[1]), e4[2])));
+        if (outside!=15) {
+            __m128 frag_depth = quantize4(zbuffer, _mm_min_ps(_mm_div_ps(z4, w4), t.zmax4));
+            __m128 zb = load4(zbuffer, row+x);
+            int pass = ~outside & _mm_movemask_ps(mode==RASTER_SHADE_EQUAL ? _mm_cmpeq_ps(frag_depth, zb) : _mm_cmpge_ps(frag_depth, zb));
+            if (pass && depthonly) { // depth only: the passing lanes are written right away
+                store4(zbuffer, row+x, frag_depth, pass);
+                written = true;
+            } else if (pass) {
+                _mm_storeu_ps(fd+x-x0, frag_depth);
+                mask |= pass<<(x-x0);
+            }
+            if (pass && shading) perspective4(q4, pass, bars+x-x0);
+        }
+        for (int i=0; i<3; i++) {
+            e4[i] = _mm_add_epi32(e4[i], t.istep4[i]);
+            q4[i] = _mm_add_ps(q4[i], t.qstep4[i]);
+        }
+        z4 = _mm_add_ps(z4, t.zstep4);
+        w4 = _mm_add_ps(w4, t.wstep4);
+    }
+    if (x<=x1) { // the scalar loop takes the remaining pixels
+        int n = x-x0;
+        e0 += n*t.ia[0];
+        e1 += n*t.ia[1];
+        e2 += n*t.ia[2];
+        c = barycentric(t, x, y);
+        q = t.Q*c;
+        z = t.zs*c;
+        w = t.ws*c;
+    }
+#endif
+    for (; x<=x1; x++, e0 += t.ia[0], e1 += t.ia[1], e2 += t.ia[2], q = q + t.qx, z += t.zx, w += t.wx) {
+        if (!inside && (e0|e1|e2)<0) continue;
+        float frag_depth = zbuffer.quantize(std::min(z/w, t.zmax));
+        float zb = zbuffer.load(row+x);
+        if (mode==RASTER_SHADE_EQUAL ? zb!=frag_depth : zb>frag_depth) continue;
+        if (shading) bars[x-x0] = perspective(q);
+        fd[x-x0] = frag_depth;
+        mask |= 1<<(x-x0);
+    }
+    if (mask) written |= commit(y, x0, mask, fd, bars, shader, target);
+    return written;
+}
+
+#ifdef __SSE2__
+// fast path for the triangles whose bbox fits in smallsize x smallsize pixels, most of the faces of a dense mesh: no block
+// walk, the coverage of the whole bbox is evaluated up front with one or two SSE steps per row, and only the covered rows
+// go through the depth test and the shading. The 4*nvec columns from bboxmin.x must lie in a single tile
+template <typename ShaderT> void fill_small(const Setup &t, Vec2i bboxmin, Vec2i bboxmax, ShaderT &shader, Target &target) {
+    DepthBuffer &zbuffer = *target.zbuffer;
+    RasterMode mode = target.mode;
+    bool shading = mode==RASTER_SHADE || mode==RASTER_SHADE_EQUAL || mode==RASTER_TRANSPARENT;
+    bool depthonly = mode==RASTER_DEPTH || mode==RASTER_CONSERVATIVE;
+    int x0 = bboxmin.x, y0 = bboxmin.y, x1 = bboxmax.x, y1 = bboxmax.y;
+    int nvec = (x1-x0)/4+1;
+
+    // hi-z: the triangle is dropped at once if it lies behind all the blocks it touches
+    float dmax = zbuffer.quantize(depthmax(t, x0, y0, x1, y1)+1.f); // +1 for the rounding of the fragment depth
+    bool visible = false;
+    for (int by=y0/hizsize; by<=y1/hizsize; by++)
+        for (int bx=x0/hizsize; bx<=x1/hizsize; bx++)
+            visible |= zbuffer.coarse[bx+by*zbuffer.coarse_width]<=dmax;
+    if (!visible) return;
+
+    int e[3];
+    edges(t, x0, y0, e);
+    __m128i e4[2][3];
+    for (int h=0; h<nvec; h++)
+        for (int i=0; i<3; i++) e4[h][i] = _mm_add_epi32(_mm_set1_epi32(e[i]+4*h*t.ia[i]), t.ia4[i]);
+    int cover[smallsize];
+    for (int y=y0; y<=y1; y++) {
+        int m = 0;
+        for (int h=0; h<nvec; h++) {
+            m |= (~_mm_movemask_ps(_mm_castsi128_ps(_mm_or_si128(_mm_or_si128(e4[h][0], e4[h][1]), e4[h][2]))) & 15)<<4*h;
+            for (int i=0; i<3; i++) e4[h][i] = _mm_add_epi32(e4[h][i], _mm_set1_epi32(t.ib[i]));
+        }
+        cover[y-y0] = m & ((1<<(x1-x0+1))-1);
+    }
+
+    bool written = false;
+    for (int y=y0; y<=y1; y++) {
+        if (!cover[y-y0]) continue;
+        int row = zbuffer.index(x0, y)-x0;
+        Vec3f c = barycentric(t, x0, y), q = t.Q*c;
+        float fd[batchsize];
+        Vec3f bars[batchsize];
+        int mask = 0;
+        for (int h=0; h<nvec; h++) {
+            int lanes = cover[y-y0]>>4*h & 15;
+            if (!lanes) continue;
+            Vec3f ch = c + t.ex*(4.f*h);
+            __m128 z4 = _mm_add_ps(_mm_set1_ps(t.zs*ch), t.zx4);
+            __m128 w4 = _mm_add_ps(_mm_set1_ps(t.ws*ch), t.wx4);
+            __m128 frag_depth = quantize4(zbuffer, _mm_min_ps(_mm_div_ps(z4, w4), t.zmax4));
+            __m128 zb = load4(zbuffer, row+x0+4*h);
+            int pass = lanes & _mm_movemask_ps(mode==RASTER_SHADE_EQUAL ? _mm_cmpeq_ps(frag_depth, zb) : _mm_cmpge_ps(frag_depth, zb));
+            if (!pass) continue;
+            if (depthonly) {
+                store4(zbuffer, row+x0+4*h, frag_depth, pass);
+                written = true;
+                continue;
+            }
+            _mm_storeu_ps(fd+4*h, frag_depth);
+            mask |= pass<<4*h;
+            if (!shading) continue;
+            Vec3f qh = q + t.qx*(4.f*h);
+            __m128 q4[3];
+            for (int i=0; i<3; i++) q4[i] = _mm_add_ps(_mm_set1_ps(qh[i]), t.qx4[i]);
+            perspective4(q4, pass, bars+4*h);
+        }
+        if (mask) written |= commit(y, x0, mask, fd, bars, shader, target);
+    }
+    if (!written) return;
+    for (int by=y0/hizsize; by<=y1/hizsize; by++)
+        for (int bx=x0/hizsize; bx<=x1/hizsize; bx++)
+            zbuffer.update_coarse(bx, by);
+}
+#endif
+
+// multisampled version of span(): the pixels covered by the triangle in at least one sample passing the depth test are
+// shaded once, at the center if it is covered and at a covered sample otherwise, the color goes to the passing samples
+template <typename ShaderT> bool span_multisample(const Setup &t, const SampleSetup &ss, int y, int x0, int x1, const int *e, ShaderT &shader, Target &target) {
+    DepthBuffer &zbuffer = *target.zbuffer;
+    int ns = zbuffer.samples;
+    int row = zbuffer.index(x0, y)-x0*ns;
+    Vec3f bars[batchsize];
+    float fd[batchsize][maxsamples];
+    int passed[batchsize]; // per pixel mask of the samples passing the coverage and the depth test
+    int mask = 0;
+    int e0 = e[0], e1 = e[1], e2 = e[2];
+    Vec3f c = barycentric(t, x0, y), q = t.Q*c;
+    float z = t.zs*c, w = t.ws*c;
+    for (int x=x0; x<=x1; x++, e0 += t.ia[0], e1 += t.ia[1], e2 += t.ia[2], q = q + t.qx, z += t.zx, w += t.wx) {
+        int pass = 0, first = -1;
+        for (int k=0; k<ns; k++) {
+            if (((e0+ss.e[k][0]) | (e1+ss.e[k][1]) | (e2+ss.e[k][2]))<0) continue;
+            if (first<0) first = k;
+            float frag_depth = zbuffer.quantize((z+ss.z[k])/(w+ss.w[k]));
+            if (zbuffer.load(row+x*ns+k)>frag_depth) continue;
+            fd[x-x0][k] = frag_depth;
+            pass |= 1<<k;
+        }
+        if (!pass) continue;
+        bars[x-x0] = perspective((e0|e1|e2)>=0 ? q : q + ss.q[first]); // no extrapolation of the varyings off the triangle
+        passed[x-x0] = pass;
+        mask |= 1<<(x-x0);
+    }
+    if (!mask) return false;
+
+    TGAColor colors[batchsize];
+    mask = shade_fragments(shader, bars, mask, colors);
+    for (int i=0; i<=x1-x0; i++) {
+        if (!(mask>>i & 1)) continue;
+        int p = row+(x0+i)*ns;
+        unsigned int *samples = &target.msimage->data[p];
+        unsigned int src[maxsamples], dst[maxsamples];
+        for (int k=0; k<ns; k++) {
+            src[k] = pack(colors[i]);
+            dst[k] = samples[k];
+        }
+        if (Blending!=BLEND_NONE) blend_row(dst, src, ns, Blending); // on the copy, the samples out of the mask stay untouched
+        for (int k=0; k<ns; k++) {
+            if (!(passed[i]>>k & 1)) continue;
+            zbuffer.store(p+k, fd[i][k]);
+            samples[k] = Blending==BLEND_NONE ? src[k] : dst[k];
+        }
+    }
+    return mask!=0;
+}
+
+// rasterizes the part of the (already clipped) triangle lying inside the [rmin, rmax] rectangle
+template <typename ShaderT> void fill(Vec4f *pts, Vec3f *bars, ShaderT &shader, Target &target, Vec2i rmin, Vec2i rmax) {
+    Vec2f s[3]; // screen coordinates of the vertices
+    for (int i=0; i<3; i++) s[i] = proj<2>(pts[i]/pts[i][3]);
+    Setup t;
+    bool conservative = target.mode==RASTER_CONSERVATIVE;
+    if (!setup(pts, s, bars, t, conservative)) return;
+    bool multisample = target.mode==RASTER_MULTISAMPLE;
+    Vec2i bboxmin, bboxmax;
+    if (!bbox(s, 3, rmin, rmax, bboxmin, bboxmax, multisample || conservative)) return;
+    SampleSetup ss;
+    if (multisample) setup_samples(t, target.zbuffer->samples, ss);
+#ifdef __SSE2__
+    if (!multisample && bboxmax.x-bboxmin.x<smallsize && bboxmax.y-bboxmin.y<smallsize &&
+        bboxmin.x%tilesize+((bboxmax.x-bboxmin.x)/4+1)*4<=tilesize) { // the vector loads stay inside a tile
+        fill_small(t, bboxmin, bboxmax, shader, target);
+        return;
+    }
+#endif
+
+    // the bbox is walked by hizsize x hizsize blocks, the blocks lying entirely behind the zbuffer content are skipped
+    for (int by=bboxmin.y/hizsize; by<=bboxmax.y/hizsize; by++) {
+        int y0 = std::max(by*hizsize, bboxmin.y), y1 = std::min(by*hizsize+hizsize-1, bboxmax.y);
+        for (int bx=bboxmin.x/hizsize; bx<=bboxmax.x/hizsize; bx++) {
+            int x0 = std::max(bx*hizsize, bboxmin.x), x1 = std::min(bx*hizsize+hizsize-1, bboxmax.x);
+            int e[3];
+            edges(t, x0, y0, e);
+            // the samples of a multisampled pixel lie off its center, the block classification is for the centers only
+            int cls = multisample ? BLOCK_PARTIAL : classify(t, e, x1-x0, y1-y0);
+            if (cls==BLOCK_OUTSIDE) continue;
+            DepthBuffer &zbuffer = *target.zbuffer;
+            int m = multisample; // the samples lie within half a pixel of the centers
+            if (zbuffer.coarse[bx+by*zbuffer.coarse_width]>zbuffer.quantize(depthmax(t, x0-m, y0-m, x1+m, y1+m)+1.f)) continue; // +1 for the rounding of the fragment depth
+            bool written = false;
+            if (multisample) {
+                for (int y=y0; y<=y1; y++, e[0] += t.ib[0], e[1] += t.ib[1], e[2] += t.ib[2])
+                    written |= span_multisample(t, ss, y, x0, x1, e, shader, target);
+            } else if (cls==BLOCK_INSIDE) {
+                for (int y=y0; y<=y1; y++, e[0] += t.ib[0], e[1] += t.ib[1], e[2] += t.ib[2])
+                    written |= span(t, y, x0, x1, e, shader, target, true);
+            } else {
+                // a partial block is split in quarters: the rows skip the outside ones and drop the coverage tests when
+                // they cross the inside ones only, the spans are not split in order to keep the shading batches full
+                int q[2][2];
+                for (int qy=0; qy<2; qy++) {
+                    for (int qx=0; qx<2; qx++) {
+                        int qx0 = x0+qx*hizsize/2, qy0 = y0+qy*hizsize/2;
+                        int qx1 = std::min(qx0+hizsize/2-1, x1), qy1 = std::min(qy0+hizsize/2-1, y1);
+                        int qe[3];
+                        for (int i=0; i<3; i++) qe[i] = e[i] + (qx0-x0)*t.ia[i] + (qy0-y0)*t.ib[i];
+                        q[qy][qx] = qx0>x1 || qy0>y1 ? BLOCK_OUTSIDE : classify(t, qe, qx1-qx0, qy1-qy0);
+                    }
+                }
+                for (int y=y0; y<=y1; y++, e[0] += t.ib[0], e[1] += t.ib[1], e[2] += t.ib[2]) {
+                    const int *r = q[(y-y0)/(hizsize/2)];
+                    if (r[0]==BLOCK_OUTSIDE && r[1]==BLOCK_OUTSIDE) continue;
+                    int sx0 = r[0]==BLOCK_OUTSIDE ? x0+hizsize/2 : x0;
+                    int sx1 = r[1]==BLOCK_OUTSIDE ? std::min(x0+hizsize/2-1, x1) : x1;
+                    int se[3];
+                    for (int i=0; i<3; i++) se[i] = e[i] + (sx0-x0)*t.ia[i];
+                    written |= span(t, y, sx0, sx1, se, shader, target, r[0]!=BLOCK_PARTIAL && r[1]!=BLOCK_PARTIAL);
+                }
+            }
+            if (written) zbuffer.update_coarse(bx, by);
+        }
+    }
+}
+
+// clips the triangle and rasterizes the part of it lying inside the [rmin, rmax] rectangle
+template <typename ShaderT> void rasterize(Vec4f *pts, ShaderT &shader, Target &target, Vec2i rmin, Vec2i rmax) {
+    Vec4f poly[maxclip];
+    Vec3f bars[maxclip];
+    bool clipped;
+    int n = clip(pts, poly, bars, clipped, target.zbuffer->format!=DEPTH_FLOAT32);
+    if (!clipped) {
+        fill(pts, NULL, shader, target, rmin, rmax);
+        return;
+    }
+    for (int k=1; k+1<n; k++) { // the clipped polygon is convex, it is rendered as a fan
+        Vec4f tri[3]  = { poly[0], poly[k], poly[k+1] };
+        Vec3f tbar[3] = { bars[0], bars[k], bars[k+1] };
+        fill(tri, tbar, shader, target, rmin, rmax);
+    }
+}
+
+// the cleared tiles are filled before the first write to them
+inline void touch(Target &target, int tile) {
+    target.zbuffer->touch(tile);
+    if (target.image)   target.image->touch(tile);
+    if (target.vbuffer) target.vbuffer->touch(tile);
+    if (target.msimage) target.msimage->touch(tile);
+    if (target.oit)     target.oit->touch(tile);
+}
+
+template <typename ShaderT> void triangle(Vec4f *pts, ShaderT &shader, ColorBuffer &image, DepthBuffer &zbuffer) {
+    if (culled(pts)) return;
+    Target target = { RASTER_SHADE, &image, &zbuffer, NULL, 0, NULL, NULL };
+    Vec2i rmax(zbuffer.width-1, zbuffer.height-1), bboxmin, bboxmax;
+    if (!face_bbox(pts, Vec2i(0, 0), rmax, bboxmin, bboxmax, 0, zbuffer.format!=DEPTH_FLOAT32)) return;
+    int ntilesx = (zbuffer.width+tilesize-1)/tilesize;
+    for (int ty=bboxmin.y/tilesize; ty<=bboxmax.y/tilesize; ty++)
+        for (int tx=bboxmin.x/tilesize; tx<=bboxmax.x/tilesize; tx++)
+            touch(target, tx+ty*ntilesx);
+    rasterize(pts, shader, target, Vec2i(0, 0), rmax);
+}
+
+// the binned tile renderer behind draw(): target.id is the visibility id base, the face index is added to it
+template <typename ShaderT> void render(ShaderT &shader, int nfaces, Target target, bool prepass) {
+    int width  = target.zbuffer->width;
+    int height = target.zbuffer->height;
+    int ntilesx = (width +tilesize-1)/tilesize;
+    int ntilesy = (height+tilesize-1)/tilesize;
+
+    // binning: every tile gets the list of the faces touching it, in the submission order
+    std::vector<std::vector<int> > bins(ntilesx*ntilesy);
+    Vec4f pts[3];
+    for (int i=0; i<nfaces; i++) {
+        for (int j=0; j<3; j++) pts[j] = shade_vertex(shader, i, j);
+        if (culled(pts)) continue;
+        Vec2i bboxmin, bboxmax; // the geometry behind the camera or off the screen is dropped here
+        int margin = target.mode==RASTER_MULTISAMPLE || target.mode==RASTER_CONSERVATIVE;
+        if (!face_bbox(pts, Vec2i(0, 0), Vec2i(width-1, height-1), bboxmin, bboxmax, margin, target.zbuffer->format!=DEPTH_FLOAT32)) continue;
+        for (int ty=bboxmin.y/tilesize; ty<=bboxmax.y/tilesize; ty++)
+            for (int tx=bboxmin.x/tilesize; tx<=bboxmax.x/tilesize; tx++)
+                bins[tx+ty*ntilesx].push_back(i);
+    }
+
+    // the tiles are disjoint, so they are rendered in parallel without any synchronization on the pixel level
+#pragma omp parallel
+    {
+        ShaderT *local = copy_shader(shader); // vertex() writes the varyings, each thread needs its own copy of the shader
+        Target tt = target;
+#pragma omp for schedule(dynamic, 1)
+        for (int t=0; t<ntilesx*ntilesy; t++) {
+            if (bins[t].empty()) continue; // a cleared tile stays so
+            touch(tt, t);
+            Vec2i rmin((t%ntilesx)*tilesize, (t/ntilesx)*tilesize);
+            Vec2i rmax(std::min(rmin.x+tilesize, width)-1, std::min(rmin.y+tilesize, height)-1);
+            // with the depth prepass the tile is rasterized twice: first the depth only, then the shading of the visible pixels.
+            // The second pass finds the pixels by depth equality, a block wrongly rejected by hi-z there leaves a hole
+            for (int pass=!prepass; pass<2; pass++) {
+                tt.mode = pass ? (prepass ? RASTER_SHADE_EQUAL : target.mode) : RASTER_DEPTH;
+                for (int k=0; k<(int)bins[t].size(); k++) {
+                    Vec4f tri[3];
+                    for (int j=0; j<3; j++) tri[j] = shade_vertex(*local, bins[t][k], j);
+                    tt.id = target.id + bins[t][k];
+                    rasterize(tri, *local, tt, rmin, rmax);
+                }
+            }
+        }
+        delete local;
+    }
+}
+
+template <typename ShaderT> void draw(ShaderT &shader, int nfaces, ColorBuffer &image, DepthBuffer &zbuffer, bool prepass) {
+    Target target = { RASTER_SHADE, &image, &zbuffer, NULL, 0, NULL, NULL };
+    render(shader, nfaces, target, prepass);
+}
+
+template <typename ShaderT> void draw(ShaderT &shader, int nfaces, MultisampleImage &msimage, DepthBuffer &zbuffer) {
+    Target target = { RASTER_MULTISAMPLE, NULL, &zbuffer, NULL, 0, &msimage, NULL };
+    render(shader, nfaces, target, false);
+}
+
+template <typename ShaderT> void draw(ShaderT &shader, int nfaces, DepthBuffer &zbuffer, bool conservative) {
+    Target target = { conservative ? RASTER_CONSERVATIVE : RASTER_DEPTH, NULL, &zbuffer, NULL, 0, NULL, NULL };
+    render(shader, nfaces, target, false);
+}
+
+template <typename ShaderT> void draw(ShaderT &shader, int nfaces, OITBuffer &oit, DepthBuffer &zbuffer) {
+    Target target = { RASTER_TRANSPARENT, NULL, &zbuffer, NULL, 0, NULL, &oit };
+    render(shader, nfaces, target, false);
+}
+
+template <typename ShaderT> void draw(int drawid, ShaderT &shader, int nfaces, VisibilityBuffer &vbuffer, DepthBuffer &zbuffer) {
+    assert(drawid>=0 && drawid<255 && nfaces<=int(facemask)); // the ids must fit faceidbits and never alias novisible
+    Target target = { RASTER_VISIBILITY, NULL, &zbuffer, &vbuffer, (unsigned int)drawid<<faceidbits, NULL, NULL };
+    render(shader, nfaces, target, false);
+}
+
+// the shading results of the resolve, SampleT being a color for the images and the surface attributes for the G-buffers
+template <typename ShaderT> int resolve_batch(ShaderT &shader, const Vec3f *bars, int mask, TGAColor *samples) {
+    return shade_fragments(shader, bars, mask, samples);
+}
+
+template <typename ShaderT> int resolve_batch(ShaderT &shader, const Vec3f *bars, int mask, Surface *samples) {
+    for (int i=0; i<batchsize; i++)
+        if (mask>>i & 1 && shade_surface(shader, bars[i], samples[i])) mask &= ~(1<<i);
+    return mask;
+}
+
+inline void touch(ColorBuffer &image, int tile) {
+    image.touch(tile);
+}
+
+inline void touch(GBuffer &gbuffer, int tile) {
+    gbuffer.touch(tile);
+}
+
+inline void store(ColorBuffer &image, int x, int y, const TGAColor &color) {
+    image.data[image.index(x, y)] = pack(color);
+}
+
+inline void store(GBuffer &gbuffer, int x, int y, const Surface &s) {
+    gbuffer.data[x+y*gbuffer.width] = s;
+    gbuffer.covered[x+y*gbuffer.width] = 1;
+}
+
+// the shading pass of the visibility buffer, one per thread
+template <typename ShaderT, typename OutT, typename SampleT> struct Resolver {
+    ShaderT &shader;
+    int drawid;
+    const VisibilityBuffer &vbuffer;
+    OutT &out;
+    FaceSetup face;
+    int current; // the face whose varyings are loaded into the shader
+
+    Resolver(ShaderT &s, int id, const VisibilityBuffer &vb, OutT &o) : shader(s), drawid(id), vbuffer(vb), out(o), face(), current(-1) {}
+
+    // the face seen by the pixel (x,y), -1 if it does not belong to the draw
+    int faceid(int x, int y) const {
+        unsigned int id = vbuffer.ids[vbuffer.index(x, y)];
+        return (id!=novisible && int(id>>faceidbits)==drawid) ? int(id & facemask) : -1;
+    }
+
+    // loads the varyings of the face into the shader if needed
+    Vec3f barycentric(int iface, int x, int y) {
+        if (iface!=current) {
+            Vec4f pts[3];
+            for (int j=0; j<3; j++) pts[j] = shade_vertex(shader, iface, j);
+            setup_face(pts, face);
+            current = iface;
+        }
+        return face_barycentric(face, x, y);
+    }
+
+    // full rate: the pixels [x0,x1] of the row y are shaded by batches of consecutive pixels of the same face
+    void row(int x0, int x1, int y) {
+        for (int b0=x0; b0<=x1; b0+=batchsize) {
+            int b1 = std::min(b0+batchsize-1, x1);
+            Vec3f bars[batchsize];
+            SampleT samples[batchsize];
+            int mask = 0, batchface = -1;
+            for (int x=b0; x<=b1+1; x++) {
+                int iface = x<=b1 ? faceid(x, y) : -1;
+                if (mask && iface!=batchface) { // flush the batch, its face is still loaded
+                    mask = resolve_batch(shader, bars, mask, samples);
+                    for (int i=0; i<=b1-b0; i++)
+                        if (mask>>i & 1) store(out, b0+i, y, samples[i]);
+                    mask = 0;
+                }
+                if (iface<0) continue;
+                bars[x-b0] = barycentric(iface, x, y);
+                batchface = iface;
+                mask |= 1<<(x-b0);
+            }
+        }
+    }
+
+    // coarse rate: every face of the block [x0,x1]x[y0,y1] is shaded at its first pixel, the result goes to all its pixels
+    void block(int x0, int y0, int x1, int y1) {
+        int faces[maxrate*maxrate], n = 0;
+        SampleT samples[maxrate*maxrate];
+        bool shaded[maxrate*maxrate];
+        for (int y=y0; y<=y1; y++) {
+            for (int x=x0; x<=x1; x++) {
+                int iface = faceid(x, y);
+                if (iface<0) continue;
+                int j = 0;
+                while (j<n && faces[j]!=iface) j++;
+                if (j==n) {
+                    Vec3f bars[batchsize];
+                    bars[0] = barycentric(iface, x, y);
+                    faces[n] = iface;
+                    shaded[n++] = resolve_batch(shader, bars, 1, samples+j)!=0;
+                }
+                if (shaded[j]) store(out, x, y, samples[j]);
+            }
+        }
+    }
+
+    // RATE_AUTO: two samples at the opposite corners of a single face block, each pixel takes the closest one
+    void adaptive(int x0, int y0, int x1, int y1, float threshold) {
+        int iface = faceid(x0, y0);
+        bool single = iface>=0 && x0<x1 && y0<y1;
+        for (int y=y0; y<=y1 && single; y++)
+            for (int x=x0; x<=x1 && single; x++)
+                single = faceid(x, y)==iface;
+        if (single) {
+            Vec3f bars[batchsize];
+            SampleT samples[batchsize];
+            bars[0] = barycentric(iface, x0, y0);
+            bars[1] = barycentric(iface, x1, y1);
+            if (resolve_batch(shader, bars, 3, samples)==3 && difference(samples[0], samples[1])<=threshold) {
+                for (int y=y0; y<=y1; y++)
+                    for (int x=x0; x<=x1; x++)
+                        store(out, x, y, samples[2*(x-x0+y-y0) > x1-x0+y1-y0]);
+                return;
+            }
+        }
+        for (int y=y0; y<=y1; y++) row(x0, x1, y); // the two samples are lost, it happens on the detailed blocks only
+    }
+};
+
+// runs the shader on the pixels of the draw, the screen tiles are resolved in parallel
+template <typename ShaderT, typename OutT, typename SampleT> void resolve_pixels(ShaderT &shader, int drawid, VisibilityBuffer &vbuffer, OutT &out, const ShadingRates *rates) {
+    int width = vbuffer.width, height = vbuffer.height;
+    int ntilesx = (width +tilesize-1)/tilesize;
+    int ntilesy = (height+tilesize-1)/tilesize;
+#pragma omp parallel
+    {
+        ShaderT *local = copy_shader(shader);
+        Resolver<ShaderT, OutT, SampleT> resolver(*local, drawid, vbuffer, out);
+#pragma omp for schedule(dynamic, 1)
+        for (int t=0; t<ntilesx*ntilesy; t++) {
+            int tx0 = (t%ntilesx)*tilesize, tx1 = std::min(tx0+tilesize, width )-1;
+            int ty0 = (t/ntilesx)*tilesize, ty1 = std::min(ty0+tilesize, height)-1;
+            if (vbuffer.cleared[t]) continue; // nothing was drawn there
+            touch(out, t);
+            ShadingRate rate = rates ? rates->rates[t] : RATE_1X1;
+            if (rate==RATE_1X1) {
+                for (int y=ty0; y<=ty1; y++) resolver.row(tx0, tx1, y);
+                continue;
+            }
+            int r = rate==RATE_AUTO ? maxrate : int(rate);
+            for (int y=ty0; y<=ty1; y+=r) {
+                for (int x=tx0; x<=tx1; x+=r) {
+                    int x1 = std::min(x+r-1, tx1), y1 = std::min(y+r-1, ty1);
+                    if (rate==RATE_AUTO) resolver.adaptive(x, y, x1, y1, rates->threshold);
+                    else resolver.block(x, y, x1, y1);
+                }
+            }
+        }
+        delete local;
+    }
+}
+
+template <typename ShaderT> void resolve(ShaderT &shader, int drawid, VisibilityBuffer &vbuffer, ColorBuffer &image, const ShadingRates *rates) {
+    resolve_pixels<ShaderT, ColorBuffer, TGAColor>(shader, drawid, vbuffer, image, rates);
+}
+
+template <typename ShaderT> void resolve(ShaderT &shader, int drawid, VisibilityBuffer &vbuffer, GBuffer &gbuffer, const ShadingRates *rates) {
+    resolve_pixels<ShaderT, GBuffer, Surface>(shader, drawid, vbuffer, gbuffer, rates);
+}
+
+// the screen tiles are lit in parallel, the tiles without any covered pixel are left as they are
+template <typename LightingT> void relight(LightingT &lighting, GBuffer &gbuffer, ColorBuffer &image) {
+    int width = gbuffer.width, height = gbuffer.height;
+    int ntilesx = (width +tilesize-1)/tilesize;
+    int ntilesy = (height+tilesize-1)/tilesize;
+#pragma omp parallel for schedule(dynamic, 1)
+    for (int t=0; t<ntilesx*ntilesy; t++) {
+        if (gbuffer.cleared[t]) continue;
+        int tx0 = (t%ntilesx)*tilesize, tx1 = std::min(tx0+tilesize, width )-1;
+        int ty0 = (t/ntilesx)*tilesize, ty1 = std::min(ty0+tilesize, height)-1;
+        for (int y=ty0; y<=ty1; y++) {
+            for (int x=tx0; x<=tx1; x++) {
+                if (!gbuffer.covered[x+y*width]) continue;
+                image.touch(t);
+                image.data[image.index(x, y)] = pack(light_surface(lighting, gbuffer.data[x+y*width]));
+            }
+        }
+    }
+}
+
+// a face of the active face table of the scanline renderer
+struct ActiveFace {
+    int iface, ymax;
+    int xmin, xmax; // the bbox columns, of the vertices snapped like for the coverage test (see face_bbox())
+    FaceSetup face;
+
+    ActiveFace() : iface(0), ymax(0), xmin(0), xmax(0), face() {}
+};
+
+template <typename ShaderT> void scanline(ShaderT &shader, int nfaces, int width, int height, IRowOutput &out) {
+    // the faces sorted by their first row, the vertex shader runs again when a face becomes active
+    std::vector<std::pair<int, int> > order;
+    Vec4f pts[3];
+    for (int i=0; i<nfaces; i++) {
+        for (int j=0; j<3; j++) pts[j] = shade_vertex(shader, i, j);
+        Vec2i bboxmin, bboxmax;
+        if (culled(pts) || !face_bbox(pts, Vec2i(0, 0), Vec2i(width-1, height-1), bboxmin, bboxmax)) continue;
+        order.push_back(std::make_pair(bboxmin.y, i));
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<ActiveFace> active;
+    std::vector<float> depths(width);
+    std::vector<int> ids(width), slots(width); // the face seen by every pixel of the row, and its index in the table
+    std::vector<TGAColor> colors(width);
+    int next = 0;
+    for (int y=0; y<height; y++) {
+        for (; next<(int)order.size() && order[next].first==y; next++) {
+            ActiveFace a;
+            a.iface = order[next].second;
+            for (int j=0; j<3; j++) pts[j] = shade_vertex(shader, a.iface, j);
+            Vec2i bboxmin, bboxmax;
+            face_bbox(pts, Vec2i(0, 0), Vec2i(width-1, height-1), bboxmin, bboxmax);
+            a.ymax = bboxmax.y;
+            a.xmin = bboxmin.x;
+            a.xmax = bboxmax.x;
+            setup_face(pts, a.face);
+            active.push_back(a);
+        }
+
+        // hidden surfaces: the nearest face wins, the last submitted one in case of a tie, as with the depth buffer
+        std::fill(depths.begin(), depths.end(), -std::numeric_limits<float>::max());
+        std::fill(ids.begin(), ids.end(), -1);
+        for (int k=0; k<(int)active.size(); k++) {
+            const ActiveFace &a = active[k];
+            for (int f=0; f<a.face.n; f++) {
+                const Setup &t = a.face.t[f];
+                int x0, x1;
+                if (!row_span(t, y, a.xmin, a.xmax, x0, x1)) continue;
+                Vec3f c = barycentric(t, x0, y);
+                float z = t.zs*c, w = t.ws*c;
+                for (int x=x0; x<=x1; x++, z += t.zx, w += t.wx) {
+                    float d = int(z/w);
+                    if (d<depths[x] || (d==depths[x] && a.iface<ids[x])) continue;
+                    depths[x] = d;
+                    ids[x] = a.iface;
+                    slots[x] = k;
+                }
+            }
+        }
+
+        // shading by batches of consecutive pixels of the same face, the faces do not discard as in the resolve of a
+        // visibility buffer
+        std::fill(colors.begin(), colors.end(), TGAColor(0, 0, 0, 0));
+        int current = -1; // the face whose varyings are loaded into the shader
+        for (int b0=0; b0<width; b0+=batchsize) {
+            int b1 = std::min(b0+batchsize-1, width-1);
+            Vec3f bars[batchsize];
+            TGAColor samples[batchsize];
+            int mask = 0, batchface = -1;
+            for (int x=b0; x<=b1+1; x++) {
+                int iface = x<=b1 ? ids[x] : -1;
+                if (mask && iface!=batchface) {
+                    mask = shade_fragments(shader, bars, mask, samples);
+                    for (int i=0; i<=b1-b0; i++)
+                        if (mask>>i & 1) colors[b0+i] = samples[i];
+                    mask = 0;
+                }
+                if (iface<0) continue;
+                if (iface!=current) {
+                    for (int j=0; j<3; j++) shade_vertex(shader, iface, j);
+                    current = iface;
+                }
+                bars[x-b0] = face_barycentric(active[slots[x]].face, x, y);
+                batchface = iface;
+                mask |= 1<<(x-b0);
+            }
+        }
+        out.row(y, &colors[0]);
+
+        for (int k=0; k<(int)active.size(); k++) { // the faces ending on this row leave the table
+            if (active[k].ymax>y) continue;
+            active[k] = active.back();
+            active.pop_back();
+            k--;
+        }
+    }
+}
+
+#endif //__RASTERIZER_H__